@@ -0,0 +1,49 @@
+// Copyright
+
+#ifndef SRC_ASYNCQUERY_HPP_
+#define SRC_ASYNCQUERY_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Building blocks of the callback-based asynchronous queries on KDTree.
+// A query runs in slices of a bounded number of visited nodes; after each
+// slice it hands its continuation to the caller's executor, so an event
+// loop can interleave many queries and keep every slice short.
+
+// Runs a continuation, now or later, on whatever thread it chooses. Each
+// query submits one continuation at a time.
+typedef std::function<void(std::function<void()>)> AsyncExecutor;
+
+enum class AsyncStatus { kDone, kCancelled, kDeadlineExceeded };
+
+// Shared flag: copies observe the same cancel().
+class CancellationToken {
+ public:
+  CancellationToken() : flag_(std::make_shared<std::atomic<bool> >(false)) {}
+  void cancel() { flag_->store(true, std::memory_order_relaxed); }
+  bool cancelled() const { return flag_->load(std::memory_order_relaxed); }
+
+ private:
+  std::shared_ptr<std::atomic<bool> > flag_;
+};
+
+struct AsyncQueryOptions {
+  size_t slice_nodes = 256;  // nodes visited before yielding
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::time_point::max();
+  CancellationToken token;
+};
+
+// Receives the status and the (squared distance, element id) list. A query
+// stopped early reports the best candidates found so far, in order.
+typedef std::function<void(AsyncStatus,
+                           std::vector<std::pair<double, uint32_t> >)>
+    KNNCallback;
+
+#endif  // SRC_ASYNCQUERY_HPP_
@@ -0,0 +1,446 @@
+// Copyright
+
+#ifndef SRC_COMPACTKDTREE_HPP_
+#define SRC_COMPACTKDTREE_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "KDTree.hpp"
+#include "Point.hpp"
+
+// Read-only, pointer-free encoding of a KDTree for memory-bound serving.
+//
+// The tree is complete and implicit: inner node i has children 2i + 1 and
+// 2i + 2, and the element range of every node follows from its level and
+// position, so nothing but the splits is stored for inner nodes. A node
+// splits its cell on the cell's widest axis, which traversal recomputes
+// from the decoded cell. Each split is two 16-bit fractions of that cell:
+// the top of the left child's cell and the bottom of the right one's, both
+// rounded outwards so the child cells still contain their points.
+//
+// Leaf coordinates are 16-bit fractions of the leaf cell, rounded down.
+// Traversal decodes cells and coordinates on the fly and prunes on the
+// resulting boxes; only points that survive that test are checked against
+// the full-precision coordinates, which sit in a separate cold array in the
+// same order, so answers are exact.
+template <size_t N, typename ElemType>
+class CompactKDTree {
+ public:
+  static const size_t kLeafSize = 8;
+  static const uint16_t kQuantMax = 0xffff;
+
+  CompactKDTree();
+  // Element ids and payloads are the tree's.
+  explicit CompactKDTree(const KDTree<N, ElemType>& tree);
+  void build(const KDTree<N, ElemType>& tree);
+
+  size_t dimension() const { return N; }
+  size_t size() const { return ids_.size(); }
+  bool empty() const { return ids_.empty(); }
+
+  bool contains(const Point<N>& pt) const;
+  const ElemType& at(const Point<N>& pt) const;
+  // Same results, order and tie-breaking as the KDTree queries.
+  std::vector<std::pair<double, uint32_t> > knn_search(const Point<N>& key,
+                                                       size_t k) const;
+  std::vector<ElemType> knn_query(const Point<N>& key, size_t k) const;
+  std::vector<std::pair<double, uint32_t> > radius_search(
+      const Point<N>& key, double radius) const;
+  std::vector<uint32_t> box_search(const Point<N>& lo,
+                                   const Point<N>& hi) const;
+  const ElemType& payload_by_id(size_t id) const { return payloads_[id]; }
+
+  // Bytes touched by traversal (splits and quantized coordinates) and
+  // bytes only read for final checks (exact coordinates and ids).
+  size_t hot_bytes() const;
+  size_t cold_bytes() const;
+
+ private:
+  typedef std::pair<double, uint32_t> Candidate;  // (squared distance, id)
+
+  struct Cell {
+    Point<N> lo, hi;
+  };
+  struct Split {
+    uint16_t leftHi;
+    uint16_t rightLo;
+  };
+
+  static double decode(double lo, double hi, uint16_t q);
+  static uint16_t quantizeDown(double lo, double hi, double value);
+  static uint16_t quantizeUp(double lo, double hi, double value);
+  static size_t widestAxis(const Cell& cell);
+  static double boxDistance(const Cell& cell, const Point<N>& key);
+  void children(size_t node, const Cell& cell, Cell& left,
+                Cell& right) const;
+  size_t rangeBegin(size_t level, size_t position) const;
+  Cell pointBox(size_t index, const Cell& leaf) const;
+
+  void buildNode(size_t level, size_t position, const Cell& cell,
+                 std::vector<std::pair<Point<N>, uint32_t> >& items);
+  bool lookup(const Point<N>& pt, size_t level, size_t position,
+              const Cell& cell, uint32_t& id) const;
+  void knnVisit(const Point<N>& key, size_t k, size_t level,
+                size_t position, const Cell& cell,
+                std::vector<Candidate>& best) const;
+  void radiusVisit(const Point<N>& key, double bound, size_t level,
+                   size_t position, const Cell& cell,
+                   std::vector<Candidate>& found) const;
+  void boxVisit(const Point<N>& lo, const Point<N>& hi, size_t level,
+                size_t position, const Cell& cell,
+                std::vector<uint32_t>& found) const;
+
+  size_t depth_;  // levels of inner nodes; leaves sit at this level
+  Cell root_;
+  std::vector<Split> splits_;       // inner nodes, breadth-first
+  std::vector<uint16_t> quantized_;  // N per element, leaf order
+  std::vector<Point<N> > exact_;    // cold: full-precision coordinates
+  std::vector<uint32_t> ids_;       // cold: element id per position
+  std::vector<ElemType> payloads_;  // by element id
+};
+
+template <size_t N, typename ElemType>
+CompactKDTree<N, ElemType>::CompactKDTree() : depth_(0) {}
+
+template <size_t N, typename ElemType>
+CompactKDTree<N, ElemType>::CompactKDTree(const KDTree<N, ElemType>& tree)
+    : depth_(0) {
+  build(tree);
+}
+
+// The last fraction decodes to hi exactly, so a cell never loses its top.
+template <size_t N, typename ElemType>
+double CompactKDTree<N, ElemType>::decode(double lo, double hi, uint16_t q) {
+  if (q == kQuantMax) return hi;
+  return lo + (hi - lo) * (static_cast<double>(q) / kQuantMax);
+}
+
+// Largest q with decode(q) <= value, for lo <= value <= hi.
+template <size_t N, typename ElemType>
+uint16_t CompactKDTree<N, ElemType>::quantizeDown(double lo, double hi,
+                                                  double value) {
+  double scaled = hi > lo ? (value - lo) / (hi - lo) * kQuantMax : 0.0;
+  int q = static_cast<int>(std::max(0.0, std::min(scaled, 65535.0)));
+  while (q > 0 && decode(lo, hi, q) > value) --q;
+  while (q < kQuantMax && decode(lo, hi, q + 1) <= value) ++q;
+  return static_cast<uint16_t>(q);
+}
+
+// Smallest q with decode(q) >= value, for lo <= value <= hi.
+template <size_t N, typename ElemType>
+uint16_t CompactKDTree<N, ElemType>::quantizeUp(double lo, double hi,
+                                                double value) {
+  double scaled = hi > lo ? std::ceil((value - lo) / (hi - lo) * kQuantMax)
+                          : 0.0;
+  int q = static_cast<int>(std::max(0.0, std::min(scaled, 65535.0)));
+  while (q < kQuantMax && decode(lo, hi, q) < value) ++q;
+  while (q > 0 && decode(lo, hi, q - 1) >= value) --q;
+  return static_cast<uint16_t>(q);
+}
+
+template <size_t N, typename ElemType>
+size_t CompactKDTree<N, ElemType>::widestAxis(const Cell& cell) {
+  size_t axis = 0;
+  for (size_t d = 1; d < N; ++d)
+    if (cell.hi[d] - cell.lo[d] > cell.hi[axis] - cell.lo[axis]) axis = d;
+  return axis;
+}
+
+template <size_t N, typename ElemType>
+double CompactKDTree<N, ElemType>::boxDistance(const Cell& cell,
+                                               const Point<N>& key) {
+  double result = 0.0;
+  for (size_t d = 0; d < N; ++d) {
+    double gap = std::max(cell.lo[d] - key[d], key[d] - cell.hi[d]);
+    if (gap > 0) result += gap * gap;
+  }
+  return result;
+}
+
+template <size_t N, typename ElemType>
+void CompactKDTree<N, ElemType>::children(size_t node, const Cell& cell,
+                                          Cell& left, Cell& right) const {
+  size_t axis = widestAxis(cell);
+  const Split& split = splits_[node];
+  left = right = cell;
+  left.hi[axis] = decode(cell.lo[axis], cell.hi[axis], split.leftHi);
+  right.lo[axis] = decode(cell.lo[axis], cell.hi[axis], split.rightLo);
+}
+
+// Node `position` of `level` covers [rangeBegin(level, position),
+// rangeBegin(level, position + 1)); halving is exact in this form.
+template <size_t N, typename ElemType>
+size_t CompactKDTree<N, ElemType>::rangeBegin(size_t level,
+                                              size_t position) const {
+  return static_cast<size_t>(
+      (static_cast<uint64_t>(position) * ids_.size()) >> level);
+}
+
+template <size_t N, typename ElemType>
+typename CompactKDTree<N, ElemType>::Cell CompactKDTree<N, ElemType>::pointBox(
+    size_t index, const Cell& leaf) const {
+  Cell box;
+  const uint16_t* q = &quantized_[index * N];
+  for (size_t d = 0; d < N; ++d) {
+    box.lo[d] = decode(leaf.lo[d], leaf.hi[d], q[d]);
+    box.hi[d] = q[d] == kQuantMax ? leaf.hi[d]
+                                  : decode(leaf.lo[d], leaf.hi[d], q[d] + 1);
+  }
+  return box;
+}
+
+template <size_t N, typename ElemType>
+void CompactKDTree<N, ElemType>::build(const KDTree<N, ElemType>& tree) {
+  KDTreeStaging<N, ElemType> staging;
+  tree.export_to(staging);
+  size_t count = staging.size();
+  if (count > UINT32_MAX) throw std::length_error("length_error");
+
+  depth_ = 0;
+  while ((kLeafSize << depth_) < count) ++depth_;
+  splits_.assign((size_t(1) << depth_) - 1, Split());
+  quantized_.assign(count * N, 0);
+  exact_.resize(count);
+  ids_.resize(count);
+  payloads_.swap(staging.values);
+
+  std::vector<std::pair<Point<N>, uint32_t> > items(count);
+  for (size_t i = 0; i < count; ++i)
+    items[i] = std::make_pair(staging.points[i], static_cast<uint32_t>(i));
+  for (size_t d = 0; d < N; ++d) {
+    root_.lo[d] = count ? staging.points[0][d] : 0.0;
+    root_.hi[d] = root_.lo[d];
+    for (size_t i = 1; i < count; ++i) {
+      root_.lo[d] = std::min(root_.lo[d], staging.points[i][d]);
+      root_.hi[d] = std::max(root_.hi[d], staging.points[i][d]);
+    }
+  }
+  buildNode(0, 0, root_, items);
+}
+
+template <size_t N, typename ElemType>
+void CompactKDTree<N, ElemType>::buildNode(
+    size_t level, size_t position, const Cell& cell,
+    std::vector<std::pair<Point<N>, uint32_t> >& items) {
+  size_t begin = rangeBegin(level, position);
+  size_t end = rangeBegin(level, position + 1);
+  if (level == depth_) {
+    for (size_t i = begin; i < end; ++i) {
+      exact_[i] = items[i].first;
+      ids_[i] = items[i].second;
+      for (size_t d = 0; d < N; ++d)
+        quantized_[i * N + d] =
+            quantizeDown(cell.lo[d], cell.hi[d], items[i].first[d]);
+    }
+    return;
+  }
+  size_t axis = widestAxis(cell);
+  size_t mid = rangeBegin(level + 1, 2 * position + 1);
+  if (begin < mid && mid < end)
+    std::nth_element(items.begin() + begin, items.begin() + mid,
+                     items.begin() + end,
+                     [axis](const std::pair<Point<N>, uint32_t>& a,
+                            const std::pair<Point<N>, uint32_t>& b) {
+                       return a.first[axis] < b.first[axis];
+                     });
+  double lo = cell.lo[axis], hi = cell.hi[axis];
+  // empty sides get an empty-looking cell at the far end
+  double leftMax = lo, rightMin = hi;
+  for (size_t i = begin; i < mid; ++i)
+    leftMax = std::max(leftMax, items[i].first[axis]);
+  for (size_t i = mid; i < end; ++i)
+    rightMin = std::min(rightMin, items[i].first[axis]);
+  size_t node = (size_t(1) << level) - 1 + position;
+  splits_[node].leftHi = quantizeUp(lo, hi, leftMax);
+  splits_[node].rightLo = quantizeDown(lo, hi, rightMin);
+
+  Cell left, right;
+  children(node, cell, left, right);
+  buildNode(level + 1, 2 * position, left, items);
+  buildNode(level + 1, 2 * position + 1, right, items);
+}
+
+template <size_t N, typename ElemType>
+bool CompactKDTree<N, ElemType>::lookup(const Point<N>& pt, size_t level,
+                                        size_t position, const Cell& cell,
+                                        uint32_t& id) const {
+  for (size_t d = 0; d < N; ++d)
+    if (!(cell.lo[d] <= pt[d] && pt[d] <= cell.hi[d])) return false;
+  if (level == depth_) {
+    size_t end = rangeBegin(level, position + 1);
+    for (size_t i = rangeBegin(level, position); i < end; ++i) {
+      if (exact_[i] == pt) {
+        id = ids_[i];
+        return true;
+      }
+    }
+    return false;
+  }
+  Cell left, right;
+  children((size_t(1) << level) - 1 + position, cell, left, right);
+  // equal coordinates at the median may sit on either side
+  return lookup(pt, level + 1, 2 * position, left, id) ||
+         lookup(pt, level + 1, 2 * position + 1, right, id);
+}
+
+template <size_t N, typename ElemType>
+bool CompactKDTree<N, ElemType>::contains(const Point<N>& pt) const {
+  uint32_t id;
+  return !empty() && lookup(pt, 0, 0, root_, id);
+}
+
+template <size_t N, typename ElemType>
+const ElemType& CompactKDTree<N, ElemType>::at(const Point<N>& pt) const {
+  uint32_t id;
+  if (!empty() && lookup(pt, 0, 0, root_, id)) return payloads_[id];
+  throw std::out_of_range("out_of_range");
+}
+
+// Max-heap of the k best; a point is decoded exactly only when its
+// quantized box could still beat the current k-th candidate.
+template <size_t N, typename ElemType>
+void CompactKDTree<N, ElemType>::knnVisit(
+    const Point<N>& key, size_t k, size_t level, size_t position,
+    const Cell& cell, std::vector<Candidate>& best) const {
+  if (level == depth_) {
+    size_t end = rangeBegin(level, position + 1);
+    for (size_t i = rangeBegin(level, position); i < end; ++i) {
+      if (best.size() == k &&
+          boxDistance(pointBox(i, cell), key) > best.front().first)
+        continue;
+      Candidate candidate(squared_distance(exact_[i], key), ids_[i]);
+      if (best.size() < k) {
+        best.push_back(candidate);
+        std::push_heap(best.begin(), best.end());
+      } else if (candidate < best.front()) {
+        std::pop_heap(best.begin(), best.end());
+        best.back() = candidate;
+        std::push_heap(best.begin(), best.end());
+      }
+    }
+    return;
+  }
+  Cell child[2];
+  children((size_t(1) << level) - 1 + position, cell, child[0], child[1]);
+  double dist[2] = {boxDistance(child[0], key), boxDistance(child[1], key)};
+  size_t near = dist[1] < dist[0] ? 1 : 0;
+  for (size_t side = near, visited = 0; visited < 2;
+       side = 1 - side, ++visited) {
+    // equal distances are still visited: a smaller id wins the tie
+    if (best.size() < k || dist[side] <= best.front().first)
+      knnVisit(key, k, level + 1, 2 * position + side, child[side], best);
+  }
+}
+
+template <size_t N, typename ElemType>
+std::vector<std::pair<double, uint32_t> >
+CompactKDTree<N, ElemType>::knn_search(const Point<N>& key, size_t k) const {
+  std::vector<Candidate> best;
+  if (k > size()) k = size();
+  if (k == 0) return best;
+  best.reserve(k);
+  knnVisit(key, k, 0, 0, root_, best);
+  std::sort_heap(best.begin(), best.end());
+  return best;
+}
+
+template <size_t N, typename ElemType>
+std::vector<ElemType> CompactKDTree<N, ElemType>::knn_query(
+    const Point<N>& key, size_t k) const {
+  std::vector<Candidate> best = knn_search(key, k);
+  std::vector<ElemType> result;
+  result.reserve(best.size());
+  for (size_t i = 0; i < best.size(); ++i)
+    result.push_back(payloads_[best[i].second]);
+  return result;
+}
+
+template <size_t N, typename ElemType>
+void CompactKDTree<N, ElemType>::radiusVisit(
+    const Point<N>& key, double bound, size_t level, size_t position,
+    const Cell& cell, std::vector<Candidate>& found) const {
+  if (boxDistance(cell, key) > bound) return;
+  if (level == depth_) {
+    size_t end = rangeBegin(level, position + 1);
+    for (size_t i = rangeBegin(level, position); i < end; ++i) {
+      if (boxDistance(pointBox(i, cell), key) > bound) continue;
+      double dist = squared_distance(exact_[i], key);
+      if (dist <= bound) found.push_back(Candidate(dist, ids_[i]));
+    }
+    return;
+  }
+  Cell left, right;
+  children((size_t(1) << level) - 1 + position, cell, left, right);
+  radiusVisit(key, bound, level + 1, 2 * position, left, found);
+  radiusVisit(key, bound, level + 1, 2 * position + 1, right, found);
+}
+
+template <size_t N, typename ElemType>
+std::vector<std::pair<double, uint32_t> >
+CompactKDTree<N, ElemType>::radius_search(const Point<N>& key,
+                                          double radius) const {
+  std::vector<Candidate> found;
+  if (!empty()) radiusVisit(key, radius * radius, 0, 0, root_, found);
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+template <size_t N, typename ElemType>
+void CompactKDTree<N, ElemType>::boxVisit(const Point<N>& lo,
+                                          const Point<N>& hi, size_t level,
+                                          size_t position, const Cell& cell,
+                                          std::vector<uint32_t>& found) const {
+  for (size_t d = 0; d < N; ++d)
+    if (cell.hi[d] < lo[d] || hi[d] < cell.lo[d]) return;
+  if (level == depth_) {
+    size_t end = rangeBegin(level, position + 1);
+    for (size_t i = rangeBegin(level, position); i < end; ++i) {
+      // the quantized box settles most points without the exact ones
+      Cell box = pointBox(i, cell);
+      bool disjoint = false, covered = true;
+      for (size_t d = 0; d < N; ++d) {
+        disjoint = disjoint || box.hi[d] < lo[d] || hi[d] < box.lo[d];
+        covered = covered && lo[d] <= box.lo[d] && box.hi[d] <= hi[d];
+      }
+      if (disjoint) continue;
+      bool inside = covered;
+      for (size_t d = 0; d < N && !covered; ++d) {
+        inside = lo[d] <= exact_[i][d] && exact_[i][d] <= hi[d];
+        if (!inside) break;
+      }
+      if (inside) found.push_back(ids_[i]);
+    }
+    return;
+  }
+  Cell left, right;
+  children((size_t(1) << level) - 1 + position, cell, left, right);
+  boxVisit(lo, hi, level + 1, 2 * position, left, found);
+  boxVisit(lo, hi, level + 1, 2 * position + 1, right, found);
+}
+
+template <size_t N, typename ElemType>
+std::vector<uint32_t> CompactKDTree<N, ElemType>::box_search(
+    const Point<N>& lo, const Point<N>& hi) const {
+  std::vector<uint32_t> found;
+  if (!empty()) boxVisit(lo, hi, 0, 0, root_, found);
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+template <size_t N, typename ElemType>
+size_t CompactKDTree<N, ElemType>::hot_bytes() const {
+  return splits_.size() * sizeof(Split) +
+         quantized_.size() * sizeof(uint16_t) + sizeof(root_);
+}
+
+template <size_t N, typename ElemType>
+size_t CompactKDTree<N, ElemType>::cold_bytes() const {
+  return exact_.size() * sizeof(Point<N>) + ids_.size() * sizeof(uint32_t);
+}
+
+#endif  // SRC_COMPACTKDTREE_HPP_
@@ -0,0 +1,250 @@
+// Copyright
+
+#ifndef SRC_DUALTREEKNN_HPP_
+#define SRC_DUALTREEKNN_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Point.hpp"
+
+// k-nearest-neighbor graph in CSR form: the neighbors of element i are
+// neighbors[offsets[i] .. offsets[i + 1]), nearest first, with their
+// euclidean distances alongside.
+struct KNNGraph {
+  std::vector<size_t> offsets;
+  std::vector<uint32_t> neighbors;
+  std::vector<double> distances;
+};
+
+// All-k-nearest-neighbors by dual-tree traversal. A bucketed tree is built
+// over the points and walked against itself: a pair (query node, reference
+// node) is skipped when the boxes are farther apart than the worst k-th
+// distance of any query in the query node. Query subtrees are independent,
+// so they are distributed over threads.
+template <size_t N>
+class DualTreeKNN {
+ public:
+  static const size_t kLeafSize = 16;
+
+  // ids[i] names points[i] in the output; ids must be 0 .. n-1.
+  DualTreeKNN(const std::vector<Point<N> >& points,
+              const std::vector<uint32_t>& ids, size_t k);
+
+  KNNGraph run(size_t threads);
+
+ private:
+  typedef std::pair<double, uint32_t> Candidate;  // (squared distance, id)
+
+  struct Node {
+    size_t begin, end;
+    size_t children[2];  // 0 for leaves; the root is never a child
+    double lo[N], hi[N];
+    double bound;  // worst k-th squared distance of the queries below
+  };
+
+  size_t build(size_t begin, size_t end);
+  static double boxDistance(const Node& one, const Node& two);
+  void baseCase(Node& query, const Node& reference);
+  void traverse(size_t query, size_t reference);
+  void offer(size_t slot, double dist, uint32_t id);
+
+  std::vector<Point<N> > points_;
+  std::vector<uint32_t> ids_;
+  std::vector<Node> nodes_;
+  size_t k_;
+  // k candidate slots per point position, kept as a max-heap
+  std::vector<Candidate> heaps_;
+  std::vector<size_t> counts_;
+};
+
+template <size_t N>
+DualTreeKNN<N>::DualTreeKNN(const std::vector<Point<N> >& points,
+                            const std::vector<uint32_t>& ids, size_t k)
+    : points_(points), ids_(ids), k_(k) {
+  if (k_ >= points_.size()) k_ = points_.empty() ? 0 : points_.size() - 1;
+  if (!points_.empty()) {
+    nodes_.reserve(2 * (points_.size() / kLeafSize + 1));
+    build(0, points_.size());
+  }
+  heaps_.resize(points_.size() * k_);
+  counts_.assign(points_.size(), 0);
+}
+
+template <size_t N>
+size_t DualTreeKNN<N>::build(size_t begin, size_t end) {
+  size_t index = nodes_.size();
+  nodes_.push_back(Node());
+  Node node;
+  node.begin = begin;
+  node.end = end;
+  node.children[0] = node.children[1] = 0;
+  node.bound = std::numeric_limits<double>::infinity();
+  for (size_t d = 0; d < N; ++d) node.lo[d] = node.hi[d] = points_[begin][d];
+  for (size_t i = begin + 1; i < end; ++i)
+    for (size_t d = 0; d < N; ++d) {
+      node.lo[d] = std::min(node.lo[d], points_[i][d]);
+      node.hi[d] = std::max(node.hi[d], points_[i][d]);
+    }
+  if (end - begin > kLeafSize) {
+    size_t axis = 0;
+    for (size_t d = 1; d < N; ++d)
+      if (node.hi[d] - node.lo[d] > node.hi[axis] - node.lo[axis]) axis = d;
+    // sort positions and ids together through a permutation
+    std::vector<size_t> order(end - begin);
+    for (size_t i = 0; i < order.size(); ++i) order[i] = begin + i;
+    size_t mid = order.size() / 2;
+    std::nth_element(order.begin(), order.begin() + mid, order.end(),
+                     [this, axis](size_t a, size_t b) {
+                       return points_[a][axis] < points_[b][axis];
+                     });
+    std::vector<Point<N> > pts(order.size());
+    std::vector<uint32_t> ids(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      pts[i] = points_[order[i]];
+      ids[i] = ids_[order[i]];
+    }
+    std::copy(pts.begin(), pts.end(), points_.begin() + begin);
+    std::copy(ids.begin(), ids.end(), ids_.begin() + begin);
+    node.children[0] = build(begin, begin + mid);
+    node.children[1] = build(begin + mid, end);
+  }
+  nodes_[index] = node;
+  return index;
+}
+
+template <size_t N>
+double DualTreeKNN<N>::boxDistance(const Node& one, const Node& two) {
+  double result = 0.0;
+  for (size_t d = 0; d < N; ++d) {
+    double gap = std::max(one.lo[d] - two.hi[d], two.lo[d] - one.hi[d]);
+    if (gap > 0) result += gap * gap;
+  }
+  return result;
+}
+
+template <size_t N>
+void DualTreeKNN<N>::offer(size_t slot, double dist, uint32_t id) {
+  Candidate* heap = &heaps_[slot * k_];
+  Candidate candidate(dist, id);
+  if (counts_[slot] < k_) {
+    heap[counts_[slot]++] = candidate;
+    std::push_heap(heap, heap + counts_[slot]);
+  } else if (candidate < heap[0]) {
+    std::pop_heap(heap, heap + k_);
+    heap[k_ - 1] = candidate;
+    std::push_heap(heap, heap + k_);
+  }
+}
+
+template <size_t N>
+void DualTreeKNN<N>::baseCase(Node& query, const Node& reference) {
+  double bound = 0.0;
+  for (size_t q = query.begin; q < query.end; ++q) {
+    for (size_t r = reference.begin; r < reference.end; ++r) {
+      if (q == r) continue;
+      offer(q, squared_distance(points_[q], points_[r]), ids_[r]);
+    }
+    double worst = counts_[q] < k_ ? std::numeric_limits<double>::infinity()
+                                   : heaps_[q * k_].first;
+    bound = std::max(bound, worst);
+  }
+  query.bound = bound;
+}
+
+template <size_t N>
+void DualTreeKNN<N>::traverse(size_t query, size_t reference) {
+  Node& q = nodes_[query];
+  const Node& r = nodes_[reference];
+  // equal distances must still be visited: a smaller id wins the tie
+  if (boxDistance(q, r) > q.bound) return;
+  bool qLeaf = q.children[0] == 0;
+  bool rLeaf = r.children[0] == 0;
+  if (qLeaf && rLeaf) {
+    baseCase(q, r);
+    return;
+  }
+  if (qLeaf) {
+    size_t near = r.children[0], far = r.children[1];
+    if (boxDistance(q, nodes_[far]) < boxDistance(q, nodes_[near]))
+      std::swap(near, far);
+    traverse(query, near);
+    traverse(query, far);
+    return;
+  }
+  for (size_t side = 0; side < 2; ++side) {
+    size_t child = q.children[side];
+    if (rLeaf) {
+      traverse(child, reference);
+      continue;
+    }
+    size_t near = r.children[0], far = r.children[1];
+    if (boxDistance(nodes_[child], nodes_[far]) <
+        boxDistance(nodes_[child], nodes_[near]))
+      std::swap(near, far);
+    traverse(child, near);
+    traverse(child, far);
+  }
+  q.bound = std::max(nodes_[q.children[0]].bound, nodes_[q.children[1]].bound);
+}
+
+template <size_t N>
+KNNGraph DualTreeKNN<N>::run(size_t threads) {
+  KNNGraph graph;
+  size_t n = points_.size();
+  graph.offsets.assign(n + 1, 0);
+  if (n == 0 || k_ == 0) return graph;
+
+  // independent query subtrees, roughly four per thread
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<size_t> tasks(1, 0);
+  for (bool split = true; split && tasks.size() < 4 * threads; ) {
+    split = false;
+    std::vector<size_t> next;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      const Node& node = nodes_[tasks[i]];
+      if (node.children[0] != 0) {
+        next.push_back(node.children[0]);
+        next.push_back(node.children[1]);
+        split = true;
+      } else {
+        next.push_back(tasks[i]);
+      }
+    }
+    tasks.swap(next);
+  }
+
+  std::atomic<size_t> nextTask(0);
+  auto worker = [this, &tasks, &nextTask]() {
+    for (size_t t = nextTask++; t < tasks.size(); t = nextTask++)
+      traverse(tasks[t], 0);
+  };
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < threads && i < tasks.size(); ++i)
+    pool.push_back(std::thread(worker));
+  worker();
+  for (size_t i = 0; i < pool.size(); ++i) pool[i].join();
+
+  // rows are emitted in id order, nearest first
+  std::vector<size_t> slotOf(n);
+  for (size_t i = 0; i < n; ++i) slotOf[ids_[i]] = i;
+  graph.neighbors.reserve(n * k_);
+  graph.distances.reserve(n * k_);
+  for (size_t id = 0; id < n; ++id) {
+    size_t slot = slotOf[id];
+    Candidate* heap = &heaps_[slot * k_];
+    std::sort_heap(heap, heap + counts_[slot]);
+    for (size_t j = 0; j < counts_[slot]; ++j) {
+      graph.neighbors.push_back(heap[j].second);
+      graph.distances.push_back(sqrt(heap[j].first));
+    }
+    graph.offsets[id + 1] = graph.neighbors.size();
+  }
+  return graph;
+}
+
+#endif  // SRC_DUALTREEKNN_HPP_
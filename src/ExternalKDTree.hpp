@@ -0,0 +1,705 @@
+// Copyright
+
+#ifndef SRC_EXTERNALKDTREE_HPP_
+#define SRC_EXTERNALKDTREE_HPP_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Point.hpp"
+
+// Out-of-core build for point sets larger than memory. The input is a file
+// of binary records (N doubles followed by a raw ElemType, the load_binary
+// format). The builder splits it on disk by the top splitting planes until a
+// partition fits the memory budget, builds that partition's subtree in
+// memory, and appends it to a single file-backed tree:
+//
+//   [header][pad to 4 KiB][records, leaf by leaf][nodes]
+//
+// Stored records carry the input position of their point's first
+// occurrence after the payload, so equal distances order as in a tree
+// built by inserting the input in order. Partitions on disk use the same
+// layout.
+//
+// Nodes are written children-first, so every subtree is finished before its
+// parent and nothing but the current partition is ever held in memory.
+// ExternalKDTree maps the file read-only and answers queries from it, with
+// each leaf a contiguous run of records.
+
+struct ExternalBuildOptions {
+  size_t memory_budget = size_t(256) << 20;  // bytes
+  size_t leaf_size = 64;                     // records per leaf
+};
+
+struct ExternalTreeHeader {
+  char magic[8];
+  uint64_t dimension;
+  uint64_t payload_size;
+  uint64_t points;
+  uint64_t nodes;
+  uint64_t root;
+  uint64_t records_offset;
+  uint64_t nodes_offset;
+};
+
+struct ExternalTreeNode {
+  static const uint32_t kLeaf = 0xffffffffu;
+  double split;
+  uint32_t axis;  // kLeaf for leaves
+  uint32_t unused;
+  uint64_t first;   // inner: left child; leaf: first record
+  uint64_t second;  // inner: right child; leaf: record count
+};
+
+static const char kExternalTreeMagic[8] = {'K', 'D', 'T', 'R',
+                                           'E', 'X', 'T', '2'};
+static const size_t kExternalTreeAlign = 4096;
+
+// Buffered sequential record writer.
+class RecordWriter {
+ public:
+  RecordWriter(const std::string& path, size_t buffer, const char* mode = "wb")
+      : file_(std::fopen(path.c_str(), mode)), written_(0) {
+    if (!file_) throw std::runtime_error("cannot create " + path);
+    buffer_.reserve(std::max<size_t>(buffer, 4096));
+  }
+  ~RecordWriter() {
+    if (file_) std::fclose(file_);
+  }
+  void write(const void* data, size_t bytes) {
+    if (buffer_.size() + bytes > buffer_.capacity()) flush();
+    const char* p = static_cast<const char*>(data);
+    if (bytes > buffer_.capacity()) {
+      if (std::fwrite(p, 1, bytes, file_) != bytes)
+        throw std::runtime_error("write failed");
+    } else {
+      buffer_.insert(buffer_.end(), p, p + bytes);
+    }
+    written_ += bytes;
+  }
+  void flush() {
+    if (!buffer_.empty() &&
+        std::fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size())
+      throw std::runtime_error("write failed");
+    buffer_.clear();
+  }
+  void close() {
+    flush();
+    if (std::fclose(file_) != 0) throw std::runtime_error("close failed");
+    file_ = nullptr;
+  }
+  uint64_t written() const { return written_; }
+  size_t buffer_bytes() const { return buffer_.capacity(); }
+  std::FILE* file() { return file_; }
+
+ private:
+  std::FILE* file_;
+  std::vector<char> buffer_;
+  uint64_t written_;
+};
+
+// Reads a record file sequentially in buffer-sized blocks.
+class RecordReader {
+ public:
+  RecordReader(const std::string& path, size_t record, size_t buffer)
+      : file_(std::fopen(path.c_str(), "rb")), record_(record), pos_(0) {
+    if (!file_) throw std::runtime_error("cannot open " + path);
+    buffer_.resize(std::max(record, buffer / record * record));
+  }
+  ~RecordReader() { std::fclose(file_); }
+  size_t buffer_bytes() const { return buffer_.size(); }
+  // Next record, or nullptr at the end of the file.
+  const char* next() {
+    if (pos_ == buffer_.size() || pos_ == filled_) {
+      filled_ = std::fread(&buffer_[0], 1, buffer_.size(), file_);
+      filled_ -= filled_ % record_;
+      pos_ = 0;
+      if (filled_ == 0) return nullptr;
+    }
+    const char* result = &buffer_[pos_];
+    pos_ += record_;
+    return result;
+  }
+
+ private:
+  std::FILE* file_;
+  size_t record_;
+  std::vector<char> buffer_;
+  size_t pos_;
+  size_t filled_ = 0;
+};
+
+// Removes a scratch file when it goes out of scope, including when a build
+// throws part way.
+class TempFile {
+ public:
+  explicit TempFile(std::string path) : path_(std::move(path)) {}
+  ~TempFile() { remove(); }
+  TempFile(const TempFile&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+  const std::string& path() const { return path_; }
+  void remove() {
+    if (!path_.empty()) std::remove(path_.c_str());
+    path_.clear();
+  }
+
+ private:
+  std::string path_;
+};
+
+template <size_t N, typename ElemType>
+class ExternalKDTreeBuilder {
+  static_assert(std::is_trivially_copyable<ElemType>::value,
+                "external trees store payloads as raw bytes");
+
+ public:
+  static const size_t kRecord = N * sizeof(double) + sizeof(ElemType);
+  static const size_t kStored = kRecord + sizeof(uint64_t);
+
+  explicit ExternalKDTreeBuilder(
+      const ExternalBuildOptions& options = ExternalBuildOptions());
+
+  // Builds output_path from the records in input_path. Neither file is
+  // ever loaded whole; peak memory stays within options.memory_budget.
+  void build(const std::string& input_path, const std::string& output_path);
+
+  // Most bytes held at once during the last build: stream buffers, the
+  // split sample, and an in-memory partition's records, index and sort
+  // scratch.
+  size_t peak_resident_bytes() const { return peak_; }
+
+ private:
+  struct Entry {
+    Point<N> point;
+    uint64_t order;     // position in the partition, for last-value-wins
+    uint64_t position;  // input position of the first occurrence
+  };
+
+  // `positioned` partitions hold stored records; the input file does not,
+  // and its positions are the record indices.
+  uint64_t buildPartition(const std::string& path, uint64_t count,
+                          bool positioned);
+  uint64_t buildInMemory(const std::string& path, uint64_t count,
+                         bool positioned);
+  uint64_t buildSubtree(std::vector<Entry>& entries, size_t begin, size_t end,
+                        const std::vector<char>& records, size_t stride);
+  void emitRecord(const char* record, uint64_t position);
+  uint64_t emitNode(const ExternalTreeNode& node);
+  std::string tempPath();
+
+  // Counts `bytes` as resident for its lifetime, updating the peak.
+  class Resident {
+   public:
+    Resident(ExternalKDTreeBuilder& builder, size_t bytes)
+        : builder_(builder), bytes_(bytes) {
+      builder_.resident_ += bytes_;
+      builder_.peak_ = std::max(builder_.peak_, builder_.resident_);
+    }
+    ~Resident() { builder_.resident_ -= bytes_; }
+    Resident(const Resident&) = delete;
+    Resident& operator=(const Resident&) = delete;
+
+   private:
+    ExternalKDTreeBuilder& builder_;
+    size_t bytes_;
+  };
+
+  ExternalBuildOptions options_;
+  std::string output_;
+  RecordWriter* records_ = nullptr;
+  RecordWriter* nodes_ = nullptr;
+  uint64_t recordCount_ = 0;
+  uint64_t nodeCount_ = 0;
+  size_t tempCounter_ = 0;
+  size_t resident_ = 0;
+  size_t peak_ = 0;
+};
+
+template <size_t N, typename ElemType>
+ExternalKDTreeBuilder<N, ElemType>::ExternalKDTreeBuilder(
+    const ExternalBuildOptions& options)
+    : options_(options) {
+  if (options_.leaf_size == 0) options_.leaf_size = 1;
+  // room for at least a leaf's worth of records plus the stream buffers
+  size_t minimum = 16 * kRecord * options_.leaf_size;
+  if (options_.memory_budget < minimum)
+    throw std::invalid_argument("memory budget too small for one leaf");
+}
+
+template <size_t N, typename ElemType>
+std::string ExternalKDTreeBuilder<N, ElemType>::tempPath() {
+  return output_ + ".part" + std::to_string(tempCounter_++);
+}
+
+template <size_t N, typename ElemType>
+void ExternalKDTreeBuilder<N, ElemType>::build(
+    const std::string& input_path, const std::string& output_path) {
+  struct stat info;
+  if (stat(input_path.c_str(), &info) != 0)
+    throw std::runtime_error("cannot stat " + input_path);
+  if (static_cast<uint64_t>(info.st_size) % kRecord != 0)
+    throw std::runtime_error("truncated record in " + input_path);
+  uint64_t count = static_cast<uint64_t>(info.st_size) / kRecord;
+
+  output_ = output_path;
+  recordCount_ = nodeCount_ = 0;
+  resident_ = peak_ = 0;
+  size_t streamBuffer = options_.memory_budget / 16;
+  TempFile nodesFile(tempPath());
+  RecordWriter records(output_path, streamBuffer);
+  RecordWriter nodes(nodesFile.path(), streamBuffer);
+  Resident writers(*this, records.buffer_bytes() + nodes.buffer_bytes());
+  records_ = &records;
+  nodes_ = &nodes;
+  std::vector<char> pad(kExternalTreeAlign, 0);
+  records.write(pad.data(), pad.size());
+
+  uint64_t root = 0;
+  if (count > 0) root = buildPartition(input_path, count, false);
+  nodes.close();
+
+  // nodes go after the records, 8-byte aligned
+  uint64_t nodesOffset = (records.written() + 7) / 8 * 8;
+  records.write(pad.data(), nodesOffset - records.written());
+  {
+    RecordReader reader(nodesFile.path(), sizeof(ExternalTreeNode),
+                        streamBuffer);
+    Resident buffer(*this, reader.buffer_bytes());
+    for (const char* node = reader.next(); node; node = reader.next())
+      records.write(node, sizeof(ExternalTreeNode));
+  }
+  nodesFile.remove();
+  records.flush();
+
+  ExternalTreeHeader header;
+  std::memcpy(header.magic, kExternalTreeMagic, sizeof(header.magic));
+  header.dimension = N;
+  header.payload_size = sizeof(ElemType);
+  header.points = recordCount_;
+  header.nodes = nodeCount_;
+  header.root = root;
+  header.records_offset = kExternalTreeAlign;
+  header.nodes_offset = nodesOffset;
+  if (std::fseek(records.file(), 0, SEEK_SET) != 0 ||
+      std::fwrite(&header, sizeof(header), 1, records.file()) != 1)
+    throw std::runtime_error("cannot write header of " + output_path);
+  records.close();
+  records_ = nodes_ = nullptr;
+}
+
+template <size_t N, typename ElemType>
+uint64_t ExternalKDTreeBuilder<N, ElemType>::emitNode(
+    const ExternalTreeNode& node) {
+  nodes_->write(&node, sizeof(node));
+  return nodeCount_++;
+}
+
+template <size_t N, typename ElemType>
+void ExternalKDTreeBuilder<N, ElemType>::emitRecord(const char* record,
+                                                    uint64_t position) {
+  records_->write(record, kRecord);
+  records_->write(&position, sizeof(position));
+}
+
+// Splits a partition on disk until it fits in memory. Splits use the
+// widest axis and the median of a bounded sample of it.
+template <size_t N, typename ElemType>
+uint64_t ExternalKDTreeBuilder<N, ElemType>::buildPartition(
+    const std::string& path, uint64_t count, bool positioned) {
+  size_t stride = positioned ? kStored : kRecord;
+  // records, the entry index and stable_sort's scratch must fit at once
+  if (count * (stride + 2 * sizeof(Entry)) <= options_.memory_budget / 2)
+    return buildInMemory(path, count, positioned);
+
+  size_t streamBuffer = options_.memory_budget / 8;
+  size_t sampleLimit = options_.memory_budget / 8 / (N * sizeof(double));
+  if (sampleLimit > count) sampleLimit = static_cast<size_t>(count);
+  std::vector<std::vector<double> > sample(N);
+  for (size_t d = 0; d < N; ++d) sample[d].reserve(sampleLimit);
+  std::unique_ptr<Resident> sampled(
+      new Resident(*this, N * sampleLimit * sizeof(double)));
+  double lo[N], hi[N];
+  for (size_t d = 0; d < N; ++d) {
+    lo[d] = std::numeric_limits<double>::infinity();
+    hi[d] = -lo[d];
+  }
+  {
+    // exact extents plus a reservoir sample, in one pass
+    std::mt19937_64 rng(count);
+    RecordReader reader(path, stride, streamBuffer);
+    Resident buffer(*this, reader.buffer_bytes());
+    uint64_t seen = 0;
+    for (const char* r = reader.next(); r; r = reader.next(), ++seen) {
+      double coords[N];
+      std::memcpy(coords, r, sizeof(coords));
+      for (size_t d = 0; d < N; ++d) {
+        lo[d] = std::min(lo[d], coords[d]);
+        hi[d] = std::max(hi[d], coords[d]);
+      }
+      uint64_t slot = seen < sampleLimit ? seen : rng() % (seen + 1);
+      if (slot < sampleLimit) {
+        for (size_t d = 0; d < N; ++d) {
+          if (seen < sampleLimit) sample[d].push_back(coords[d]);
+          else sample[d][slot] = coords[d];
+        }
+      }
+    }
+  }
+  size_t axis = 0;
+  for (size_t d = 1; d < N; ++d)
+    if (hi[d] - lo[d] > hi[axis] - lo[axis]) axis = d;
+  if (!(hi[axis] > lo[axis])) {
+    // every record is the same point: the last one wins, the first one
+    // gives the position
+    std::vector<char> last(kRecord);
+    uint64_t first = 0;
+    RecordReader reader(path, stride, streamBuffer);
+    Resident buffer(*this, reader.buffer_bytes());
+    const char* r = reader.next();
+    if (positioned) std::memcpy(&first, r + kRecord, sizeof(first));
+    for ( ; r; r = reader.next()) std::memcpy(&last[0], r, kRecord);
+    emitRecord(&last[0], first);
+    ExternalTreeNode leaf = {0.0, ExternalTreeNode::kLeaf, 0, recordCount_, 1};
+    recordCount_ += 1;
+    return emitNode(leaf);
+  }
+  // left gets coord <= split; keep both sides non-empty
+  std::vector<double>& values = sample[axis];
+  std::nth_element(values.begin(), values.begin() + values.size() / 2,
+                   values.end());
+  double split = values[values.size() / 2];
+  if (!(split < hi[axis])) split = lo[axis] + (hi[axis] - lo[axis]) / 2;
+  if (!(split < hi[axis])) split = lo[axis];
+  for (size_t d = 0; d < N; ++d) std::vector<double>().swap(sample[d]);
+  sampled.reset();
+
+  TempFile leftFile(tempPath()), rightFile(tempPath());
+  uint64_t leftCount = 0, rightCount = 0;
+  {
+    RecordReader reader(path, stride, streamBuffer);
+    RecordWriter left(leftFile.path(), streamBuffer);
+    RecordWriter right(rightFile.path(), streamBuffer);
+    Resident buffers(*this, reader.buffer_bytes() + left.buffer_bytes() +
+                                right.buffer_bytes());
+    uint64_t seen = 0;
+    for (const char* r = reader.next(); r; r = reader.next(), ++seen) {
+      double coord;
+      std::memcpy(&coord, r + axis * sizeof(double), sizeof(coord));
+      uint64_t position = seen;
+      if (positioned) std::memcpy(&position, r + kRecord, sizeof(position));
+      RecordWriter& side = coord <= split ? left : right;
+      side.write(r, kRecord);
+      side.write(&position, sizeof(position));
+      ++(coord <= split ? leftCount : rightCount);
+    }
+    left.close();
+    right.close();
+  }
+  uint64_t leftNode = buildPartition(leftFile.path(), leftCount, true);
+  leftFile.remove();
+  uint64_t rightNode = buildPartition(rightFile.path(), rightCount, true);
+  rightFile.remove();
+  ExternalTreeNode inner = {split, static_cast<uint32_t>(axis), 0, leftNode,
+                            rightNode};
+  return emitNode(inner);
+}
+
+template <size_t N, typename ElemType>
+uint64_t ExternalKDTreeBuilder<N, ElemType>::buildInMemory(
+    const std::string& path, uint64_t count, bool positioned) {
+  size_t stride = positioned ? kStored : kRecord;
+  std::vector<char> records(count * stride);
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file) throw std::runtime_error("cannot open " + path);
+  size_t read = std::fread(records.data(), 1, records.size(), file);
+  std::fclose(file);
+  if (read != records.size()) throw std::runtime_error("short read of " + path);
+
+  std::vector<Entry> entries(count);
+  for (uint64_t i = 0; i < count; ++i) {
+    std::memcpy(entries[i].point.begin(), &records[i * stride],
+                N * sizeof(double));
+    entries[i].order = i;
+    entries[i].position = i;
+    if (positioned)
+      std::memcpy(&entries[i].position, &records[i * stride + kRecord],
+                  sizeof(uint64_t));
+  }
+  Resident partition(*this,
+                     records.size() + 2 * entries.size() * sizeof(Entry));
+
+  // equal points always land in the same partition: merge them here,
+  // keeping the record that came last and the position that came first
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry& a, const Entry& b) {
+                     return std::lexicographical_compare(
+                         a.point.begin(), a.point.end(), b.point.begin(),
+                         b.point.end());
+                   });
+  size_t unique = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (unique > 0 && entries[unique - 1].point == entries[i].point) {
+      uint64_t first = entries[unique - 1].position;
+      entries[unique - 1] = entries[i];
+      entries[unique - 1].position = first;
+    } else {
+      entries[unique++] = entries[i];
+    }
+  }
+  entries.resize(unique);
+  return buildSubtree(entries, 0, entries.size(), records, stride);
+}
+
+template <size_t N, typename ElemType>
+uint64_t ExternalKDTreeBuilder<N, ElemType>::buildSubtree(
+    std::vector<Entry>& entries, size_t begin, size_t end,
+    const std::vector<char>& records, size_t stride) {
+  if (end - begin <= options_.leaf_size) {
+    ExternalTreeNode leaf = {0.0, ExternalTreeNode::kLeaf, 0, recordCount_,
+                             end - begin};
+    for (size_t i = begin; i < end; ++i)
+      emitRecord(&records[entries[i].order * stride], entries[i].position);
+    recordCount_ += end - begin;
+    return emitNode(leaf);
+  }
+  double lo[N], hi[N];
+  for (size_t d = 0; d < N; ++d) lo[d] = hi[d] = entries[begin].point[d];
+  for (size_t i = begin + 1; i < end; ++i)
+    for (size_t d = 0; d < N; ++d) {
+      lo[d] = std::min(lo[d], entries[i].point[d]);
+      hi[d] = std::max(hi[d], entries[i].point[d]);
+    }
+  size_t axis = 0;
+  for (size_t d = 1; d < N; ++d)
+    if (hi[d] - lo[d] > hi[axis] - lo[axis]) axis = d;
+  // median on the widest axis; distinct points guarantee a non-empty right
+  size_t mid = begin + (end - begin) / 2;
+  std::nth_element(entries.begin() + begin, entries.begin() + mid,
+                   entries.begin() + end,
+                   [axis](const Entry& a, const Entry& b) {
+                     return a.point[axis] < b.point[axis];
+                   });
+  double split = entries[mid].point[axis];
+  if (!(split < hi[axis])) {
+    split = lo[axis];
+    for (size_t i = begin; i < end; ++i)
+      if (entries[i].point[axis] < hi[axis])
+        split = std::max(split, entries[i].point[axis]);
+  }
+  size_t right = std::partition(entries.begin() + begin, entries.begin() + end,
+                                [axis, split](const Entry& e) {
+                                  return e.point[axis] <= split;
+                                }) -
+                 entries.begin();
+  uint64_t leftNode = buildSubtree(entries, begin, right, records, stride);
+  uint64_t rightNode = buildSubtree(entries, right, end, records, stride);
+  ExternalTreeNode inner = {split, static_cast<uint32_t>(axis), 0, leftNode,
+                            rightNode};
+  return emitNode(inner);
+}
+
+// Read-only view of a file built by ExternalKDTreeBuilder. The file is
+// mapped, not loaded: queries fault in only the node and leaf pages they
+// touch, and leaves are contiguous runs of records.
+template <size_t N, typename ElemType>
+class ExternalKDTree {
+ public:
+  static const size_t kRecord = N * sizeof(double) + sizeof(ElemType);
+  static const size_t kStored = kRecord + sizeof(uint64_t);
+
+  explicit ExternalKDTree(const std::string& path);
+  ~ExternalKDTree();
+  ExternalKDTree(const ExternalKDTree&) = delete;
+  ExternalKDTree& operator=(const ExternalKDTree&) = delete;
+
+  size_t dimension() const { return N; }
+  size_t size() const { return header_.points; }
+  bool empty() const { return header_.points == 0; }
+
+  bool contains(const Point<N>& pt) const;
+  ElemType at(const Point<N>& pt) const;
+  // Nearest first; equal distances in input order.
+  std::vector<ElemType> knn_query(const Point<N>& key, size_t k) const;
+
+ private:
+  // (squared distance, input position, record)
+  typedef std::tuple<double, uint64_t, uint64_t> Candidate;
+
+  const ExternalTreeNode& node(uint64_t index) const {
+    return nodes_[index];
+  }
+  Point<N> pointAt(uint64_t record) const;
+  ElemType payloadAt(uint64_t record) const;
+  uint64_t positionAt(uint64_t record) const;
+  bool lookup(const Point<N>& pt, uint64_t& record) const;
+  void knnVisit(uint64_t index, const Point<N>& key, size_t k,
+                std::priority_queue<Candidate>& best) const;
+
+  const char* data_;
+  size_t bytes_;
+  ExternalTreeHeader header_;
+  const ExternalTreeNode* nodes_;
+};
+
+template <size_t N, typename ElemType>
+ExternalKDTree<N, ElemType>::ExternalKDTree(const std::string& path)
+    : data_(nullptr), bytes_(0), nodes_(nullptr) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open " + path);
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(ExternalTreeHeader)) {
+    close(fd);
+    throw std::runtime_error("not an external tree: " + path);
+  }
+  bytes_ = static_cast<size_t>(info.st_size);
+  void* addr = mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+  // queries jump around; don't read ahead of the pages they touch
+  madvise(addr, bytes_, MADV_RANDOM);
+  data_ = static_cast<const char*>(addr);
+  std::memcpy(&header_, data_, sizeof(header_));
+  if (std::memcmp(header_.magic, kExternalTreeMagic, sizeof(header_.magic)) ||
+      header_.dimension != N || header_.payload_size != sizeof(ElemType)) {
+    munmap(addr, bytes_);
+    throw std::runtime_error("not an external tree for this type: " + path);
+  }
+  // records then nodes, each wholly inside the file; checked by division
+  // so corrupt counts cannot overflow
+  const ExternalTreeHeader& h = header_;
+  bool sized =
+      h.records_offset >= sizeof(ExternalTreeHeader) &&
+      h.records_offset <= h.nodes_offset && h.nodes_offset <= bytes_ &&
+      h.nodes_offset % alignof(ExternalTreeNode) == 0 &&
+      h.points <= (h.nodes_offset - h.records_offset) / kStored &&
+      h.nodes <= (bytes_ - h.nodes_offset) / sizeof(ExternalTreeNode) &&
+      (h.points == 0 || h.root < h.nodes);
+  if (!sized) {
+    munmap(addr, bytes_);
+    throw std::runtime_error("truncated or corrupt external tree: " + path);
+  }
+  nodes_ = reinterpret_cast<const ExternalTreeNode*>(data_ +
+                                                     header_.nodes_offset);
+}
+
+template <size_t N, typename ElemType>
+ExternalKDTree<N, ElemType>::~ExternalKDTree() {
+  munmap(const_cast<char*>(data_), bytes_);
+}
+
+template <size_t N, typename ElemType>
+Point<N> ExternalKDTree<N, ElemType>::pointAt(uint64_t record) const {
+  Point<N> result;
+  std::memcpy(result.begin(), data_ + header_.records_offset + record * kStored,
+              N * sizeof(double));
+  return result;
+}
+
+template <size_t N, typename ElemType>
+ElemType ExternalKDTree<N, ElemType>::payloadAt(uint64_t record) const {
+  ElemType result;
+  std::memcpy(&result,
+              data_ + header_.records_offset + record * kStored +
+                  N * sizeof(double),
+              sizeof(ElemType));
+  return result;
+}
+
+template <size_t N, typename ElemType>
+uint64_t ExternalKDTree<N, ElemType>::positionAt(uint64_t record) const {
+  uint64_t result;
+  std::memcpy(&result,
+              data_ + header_.records_offset + record * kStored + kRecord,
+              sizeof(result));
+  return result;
+}
+
+template <size_t N, typename ElemType>
+bool ExternalKDTree<N, ElemType>::lookup(const Point<N>& pt,
+                                         uint64_t& record) const {
+  if (empty()) return false;
+  uint64_t index = header_.root;
+  while (node(index).axis != ExternalTreeNode::kLeaf) {
+    const ExternalTreeNode& inner = node(index);
+    index = pt[inner.axis] <= inner.split ? inner.first : inner.second;
+  }
+  const ExternalTreeNode& leaf = node(index);
+  for (uint64_t r = leaf.first; r < leaf.first + leaf.second; ++r) {
+    if (pointAt(r) == pt) {
+      record = r;
+      return true;
+    }
+  }
+  return false;
+}
+
+template <size_t N, typename ElemType>
+bool ExternalKDTree<N, ElemType>::contains(const Point<N>& pt) const {
+  uint64_t record;
+  return lookup(pt, record);
+}
+
+template <size_t N, typename ElemType>
+ElemType ExternalKDTree<N, ElemType>::at(const Point<N>& pt) const {
+  uint64_t record;
+  if (lookup(pt, record)) return payloadAt(record);
+  throw std::out_of_range("out_of_range");
+}
+
+template <size_t N, typename ElemType>
+void ExternalKDTree<N, ElemType>::knnVisit(
+    uint64_t index, const Point<N>& key, size_t k,
+    std::priority_queue<Candidate>& best) const {
+  const ExternalTreeNode& current = node(index);
+  if (current.axis == ExternalTreeNode::kLeaf) {
+    for (uint64_t r = current.first; r < current.first + current.second; ++r) {
+      Candidate candidate(squared_distance(pointAt(r), key), positionAt(r), r);
+      if (best.size() < k) {
+        best.push(candidate);
+      } else if (candidate < best.top()) {
+        best.pop();
+        best.push(candidate);
+      }
+    }
+    return;
+  }
+  double gap = key[current.axis] - current.split;
+  bool nearLeft = gap <= 0;
+  knnVisit(nearLeft ? current.first : current.second, key, k, best);
+  if (best.size() < k || gap * gap <= std::get<0>(best.top()))
+    knnVisit(nearLeft ? current.second : current.first, key, k, best);
+}
+
+template <size_t N, typename ElemType>
+std::vector<ElemType> ExternalKDTree<N, ElemType>::knn_query(
+    const Point<N>& key, size_t k) const {
+  std::vector<ElemType> result;
+  if (k > size()) k = size();
+  if (k == 0) return result;
+  std::priority_queue<Candidate> best;
+  knnVisit(header_.root, key, k, best);
+  result.resize(best.size());
+  for (size_t i = result.size(); i-- > 0; best.pop())
+    result[i] = payloadAt(std::get<2>(best.top()));
+  return result;
+}
+
+#endif  // SRC_EXTERNALKDTREE_HPP_
@@ -3,37 +3,140 @@
 #ifndef SRC_KDTREE_HPP_
 #define SRC_KDTREE_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <new>
 #include <set>
 #include <stdexcept>
 #include <utility>
 #include <vector>
+#include "AsyncQuery.hpp"
+#include "DualTreeKNN.hpp"
 #include "Point.hpp"
+#include "PointHashIndex.hpp"
+#include "QueryCache.hpp"
 
+#if defined(__GNUC__) || defined(__clang__)
+#define KDTREE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define KDTREE_PREFETCH(addr) ((void)0)
+#endif
 
 using namespace std;
-template <typename value_type>
+// Nodes hold only what traversal compares: the coordinates and the index
+// of the element's payload in the tree's out-of-line payload array. The
+// optional subtree bounding box is referenced by index from what would
+// otherwise be padding after payloadIndex.
+template <size_t N>
 class KDTreeNode{
 public: 
-  value_type nodeValue;
-  KDTreeNode<value_type>* nextNodes[2];
-  KDTreeNode(const value_type& _nodeValue){
-    nodeValue = _nodeValue;
+  static const uint32_t kNoBox = 0xffffffffu;
+  Point<N> nodePoint;
+  uint32_t payloadIndex;
+  uint32_t boxIndex;
+  KDTreeNode<N>* nextNodes[2];
+  KDTreeNode(const Point<N>& _nodePoint, uint32_t _payloadIndex){
+    nodePoint = _nodePoint;
+    payloadIndex = _payloadIndex;
+    boxIndex = kNoBox;
     nextNodes[0] = 0;
     nextNodes[1] = 0;
   }
-  KDTreeNode(value_type _nodeValue, KDTreeNode<value_type>* Lnode, KDTreeNode<value_type>* Rnode){
-    nodeValue = _nodeValue;
+  KDTreeNode(const Point<N>& _nodePoint, uint32_t _payloadIndex, KDTreeNode<N>* Lnode, KDTreeNode<N>* Rnode){
+    nodePoint = _nodePoint;
+    payloadIndex = _payloadIndex;
+    boxIndex = kNoBox;
     nextNodes[0] = Lnode;
     nextNodes[1] = Rnode;
   }
 };
 
+// Tight axis-aligned bounds of a subtree.
+template <size_t N>
+struct KDTreeBox {
+  Point<N> lo, hi;
+};
+
+// Block allocator for the nodes of one tree. The tree never removes single
+// elements, so nodes are only ever released all together; allocation is a
+// pointer bump and nodes built together sit next to each other.
+template <size_t N>
+class KDTreeNodePool {
+ public:
+  static const size_t kMinBlock = 64;
+  static const size_t kMaxBlock = size_t(1) << 16;
+
+  KDTreeNodePool() : next_(nullptr), left_(0), allocated_(0) {}
+  ~KDTreeNodePool() { clear(); }
+  KDTreeNodePool(const KDTreeNodePool&) = delete;
+  KDTreeNodePool& operator=(const KDTreeNodePool&) = delete;
+
+  KDTreeNode<N>* create(const Point<N>& pt, uint32_t payloadIndex) {
+    if (left_ == 0) grow(nextBlock());
+    --left_;
+    ++allocated_;
+    return new (next_++) KDTreeNode<N>(pt, payloadIndex);
+  }
+  // Makes the next `count` creations come from one block.
+  void reserve(size_t count) {
+    if (left_ < count) grow(count < nextBlock() ? nextBlock() : count);
+  }
+  // Releases every node.
+  void clear() {
+    for (size_t i = 0; i < blocks_.size(); i++) ::operator delete(blocks_[i]);
+    blocks_.clear();
+    next_ = nullptr;
+    left_ = 0;
+    allocated_ = 0;
+  }
+
+ private:
+  // blocks double with the pool, between kMinBlock and kMaxBlock nodes
+  size_t nextBlock() const {
+    return allocated_ < kMinBlock ? kMinBlock : allocated_ > kMaxBlock ? kMaxBlock : allocated_;
+  }
+  void grow(size_t count) {
+    void* block = ::operator new(count * sizeof(KDTreeNode<N>));
+    blocks_.push_back(block);
+    next_ = static_cast<KDTreeNode<N>*>(block);
+    left_ = count;
+  }
+
+  vector<void*> blocks_;
+  KDTreeNode<N>* next_;
+  size_t left_;
+  size_t allocated_;
+};
+
+// Bulk-build staging buffer: coordinates and payloads in parallel arrays,
+// filled directly by loaders and consumed by KDTree::bulk_load.
+template <size_t N, typename ElemType>
+struct KDTreeStaging {
+  vector<Point<N>> points;
+  vector<ElemType> values;
+
+  size_t size() const { return points.size(); }
+  void resize(size_t count) {
+    points.resize(count);
+    values.resize(count);
+  }
+  void clear() {
+    points.clear();
+    values.clear();
+  }
+};
+
 template <size_t N, typename ElemType>
 class KDTree {
  public:
   typedef pair<Point<N>, ElemType> value_type;
+  typedef KDTreeNode<N> node_type;
 
   KDTree();
 
@@ -50,6 +153,22 @@ class KDTree {
   bool contains(const Point<N> &pt) const;
 
   void insert(const Point<N> &pt, const ElemType &value);
+  // Same result as inserting the staged pairs in order (a repeated point
+  // keeps its first id and its last value); an empty tree is built
+  // balanced by median splits. The staging buffer is left empty.
+  void bulk_load(KDTreeStaging<N, ElemType>& staging);
+  // Same result as inserting the value_type pairs of [first, last) in
+  // order. The batch is routed down the existing splits in groups and each
+  // group that reaches an empty slot is hung there as a balanced subtree.
+  // New nodes deeper than log(size) / log(1 / kBatchBalance) make the
+  // lowest ancestor with a child over kBatchBalance of its size be
+  // rebuilt balanced, reusing its nodes (as in a scapegoat tree).
+  static constexpr double kBatchBalance = 0.75;
+  template <typename InputIt>
+  void insert_batch(InputIt first, InputIt last);
+  // Replaces the staging contents with every element in id order, so
+  // bulk-loading it elsewhere keeps the ids.
+  void export_to(KDTreeStaging<N, ElemType>& staging) const;
   
   ElemType &operator[](const Point<N> &pt);
 
@@ -57,79 +176,450 @@ class KDTree {
   const ElemType &at(const Point<N> &pt) const;
 
   //Add
-  bool find(const Point<N>& pt, KDTreeNode<value_type>**& ptrNode) const;
- void knnIterator(Point<N> key, KDTreeNode<value_type>* currentNode, vector<pair<ElemType, double>>& vecContent, int level) const;
+  // Split axis of the level below one split on `axis`.
+  static constexpr size_t nextAxis(size_t axis) { return axis + 1 == N ? 0 : axis + 1; }
+  bool find(const Point<N>& pt, node_type**& ptrNode) const;
+  // Batched lookups: up to kBatchGroup descents are kept in flight and
+  // advanced one level at a time, prefetching each query's next node so
+  // the memory stalls of independent lookups overlap.
+  static const size_t kBatchGroup = 16;
+  void find_batch(const Point<N>* pts, size_t count, node_type** nodes) const;
+  vector<bool> contains_batch(const vector<Point<N>>& pts) const;
+  // Payload of a node; traversal itself never touches payloads.
+  ElemType& payload(const node_type* node);
+  const ElemType& payload(const node_type* node) const;
+ void knnIterator(const Point<N>& key, const node_type* currentNode, size_t axis, size_t k, vector<pair<double, uint32_t>>& vecContent) const;
+    // Most common payload among the k nearest; k is clamped to size() and
+    // out_of_range is thrown when no neighbour is left to vote.
     ElemType knn_value(const Point<N>& key, size_t k) const;
     vector<ElemType> knn_query(const Point<N>& key, size_t k) const;
+    // (squared distance, element id) of the k nearest elements, nearest
+    // first; equal distances are ordered by id.
+    vector<pair<double, uint32_t>> knn_search(const Point<N>& key, size_t k) const;
+    // knn_search run in slices of options.slice_nodes visited nodes, each
+    // submitted to `executor`; `done` is called from the last slice. The
+    // executor may run a slice inline: slices then loop in the current
+    // call instead of nesting. The query cache is not consulted. The tree
+    // must outlive the query and must not change while it runs.
+    void knn_search_async(const Point<N>& key, size_t k, const AsyncExecutor& executor, KNNCallback done,
+                          const AsyncQueryOptions& options = AsyncQueryOptions()) const;
+    // Every element within `radius` of key, same format and order.
+    vector<pair<double, uint32_t>> radius_search(const Point<N>& key, double radius) const;
+    // Ids of every element inside the closed box [lo, hi], ascending.
+    vector<uint32_t> box_search(const Point<N>& lo, const Point<N>& hi) const;
+    const ElemType& payload_by_id(size_t id) const;
+    // k-NN graph of every element, excluding the element itself. Rows and
+    // neighbor ids are element ids (insertion order), ties broken by id as
+    // in knn_query. threads = 0 uses every hardware thread.
+    KNNGraph all_knn(size_t k, size_t threads = 0) const;
+
+  // Optional exact-match hash index kept next to the tree: contains, at,
+  // operator[] and the batch lookups become O(1) probes while spatial
+  // queries keep using the tree. It is maintained by every insert.
+  void enable_hash_index();
+  void disable_hash_index();
+  bool hash_index_enabled() const;
+
+  // Optional cache of knn_search results (and so of knn_query/knn_value),
+  // holding up to `capacity` (query, k) entries with CLOCK eviction. A
+  // positive quantum makes queries in the same grid cell share an entry.
+  // Any insert of a new point invalidates it; copies start cold.
+  void enable_query_cache(size_t capacity, double quantum = 0.0);
+  void disable_query_cache();
+  bool query_cache_enabled() const;
+  QueryCacheStats query_cache_stats() const;
+
+  // Optional per-node bounding boxes of each subtree, kept up to date by
+  // insert and bulk_load. k-NN, radius and box queries then prune on the
+  // distance to a subtree's box rather than to its splitting plane, and
+  // radius and box queries emit fully covered subtrees without testing
+  // each point.
+  void enable_bounding_boxes();
+  void disable_bounding_boxes();
+  bool bounding_boxes_enabled() const;
  private:
-  KDTreeNode<value_type>* headNode= nullptr;
-  size_t dimension_;
+  node_type* headNode= nullptr;
+  // Payloads live out of line, indexed by node_type::payloadIndex; a deque
+  // keeps references returned by at/operator[] valid across inserts.
+  deque<ElemType> payloads_;
   size_t size_;
+  KDTreeNodePool<N> pool_;
+  unique_ptr<PointHashIndex<N, node_type>> hashIndex_;
+  // bumped whenever the set of points changes
+  uint64_t generation_ = 0;
+  unique_ptr<KNNQueryCache<N>> queryCache_;
+  bool boxesEnabled_ = false;
+  vector<KDTreeBox<N>> boxes_;  // indexed by node_type::boxIndex
+
+  // Pending subtree of a resumable k-NN search; `bound` is a lower bound
+  // on the squared distance of anything in it.
+  struct KNNFrame {
+    const node_type* node;
+    size_t axis;
+    double bound;
+  };
+  struct KNNTask;
+  static void offerCandidate(vector<pair<double, uint32_t>>& heap, size_t k, const pair<double, uint32_t>& candidate);
+  void knnSteps(const Point<N>& key, size_t k, size_t budget, vector<KNNFrame>& stack, vector<pair<double, uint32_t>>& heap) const;
+  static void runKNNTask(const shared_ptr<KNNTask>& task);
+
+  uint32_t addPayload(const ElemType& value);
+  node_type* lookup(const Point<N>& pt) const;
+  node_type* insertNode(const Point<N>& pt, const ElemType& value, bool& inserted);
+  vector<pair<double, uint32_t>> knnSearch(const Point<N>& key, size_t k) const;
+  void radiusIterator(const Point<N>& key, const node_type* node, size_t axis, double bound, vector<pair<double, uint32_t>>& found) const;
+  uint32_t buildBoxes(node_type* node);
+  void growBoxes(node_type* node);
+  void widenAncestors(node_type* node);
+  double boxDistance(const node_type* node, const Point<N>& key) const;
+  double boxFarDistance(const node_type* node, const Point<N>& key) const;
+  void emitSubtree(const Point<N>& key, const node_type* node, vector<pair<double, uint32_t>>& found) const;
+  void emitSubtree(const node_type* node, vector<uint32_t>& found) const;
+  void boxIterator(const Point<N>& lo, const Point<N>& hi, const node_type* node, size_t axis, vector<uint32_t>& found) const;
+  typedef pair<Point<N>, node_type*> BuildEntry;
+  node_type* buildBalanced(BuildEntry* begin, BuildEntry* end, size_t axis);
+
+  // A distinct point of an insert_batch call: where it first and last
+  // occurs in the batch, and its id once known.
+  struct BatchEntry {
+    Point<N> point;
+    size_t first;
+    size_t last;
+    uint32_t id;
+  };
+  // An empty slot at `depth`, the new batch points that reach it and the
+  // subtree built from them.
+  struct BatchTarget {
+    node_type** slot;
+    size_t depth;
+    BatchEntry* begin;
+    BatchEntry* end;
+    node_type* root;
+  };
+  void insertBatch(const vector<Point<N>>& points, const vector<ElemType>& values);
+  void routeBatch(node_type** slot, size_t depth, BatchEntry* begin, BatchEntry* end, const vector<ElemType>& values, vector<BatchTarget>& targets, vector<BatchTarget>& walks);
+  void descendBatch(vector<BatchTarget>& walks, const vector<ElemType>& values, vector<BatchTarget>& targets);
+  void rebalanceAbove(const node_type* node, double bound, vector<BuildEntry>& scratch);
+  size_t countNodes(const node_type* node) const;
+  void collectNodes(node_type* node, vector<BuildEntry>& nodes) const;
 };
 
 //functions
-template <typename value_type>
-void killNodes(KDTreeNode<value_type>* node){
-  if(node != nullptr){
-    killNodes((node->nextNodes)[0]);
-    killNodes((node->nextNodes)[1]);
-    delete node;
-  }
-}
-
-template <typename value_type>
-KDTreeNode<value_type>* initNode(const KDTreeNode<value_type>* tempNode){
-  const KDTreeNode<value_type>* LtempNode=tempNode->nextNodes[0];
-  const KDTreeNode<value_type>* RtempNode=tempNode->nextNodes[1];
-  const  value_type tempValue= tempNode->nodeValue;
-  KDTreeNode<value_type>* nodeCopy=nullptr;
+template <size_t N>
+KDTreeNode<N>* initNode(const KDTreeNode<N>* tempNode, KDTreeNodePool<N>& pool){
+  KDTreeNode<N>* nodeCopy=nullptr;
   if (tempNode != nullptr) {
-    nodeCopy = new KDTreeNode<value_type>(tempValue, initNode(LtempNode), initNode(RtempNode));
+    nodeCopy = pool.create(tempNode->nodePoint, tempNode->payloadIndex);
+    nodeCopy->nextNodes[0] = initNode(tempNode->nextNodes[0], pool);
+    nodeCopy->nextNodes[1] = initNode(tempNode->nextNodes[1], pool);
   }
   return nodeCopy;
 }
 
 template <size_t N, typename ElemType>
-bool KDTree<N, ElemType>::find(const Point<N>& pt, KDTreeNode<value_type>**& ptrNode) const {
-  size_t iterator = 0;
-  ptrNode = const_cast<KDTreeNode<value_type>**> (&headNode);
-  for ( ; *ptrNode and ((*ptrNode)->nodeValue).first != pt;
-    ptrNode = &((*ptrNode)->nextNodes[pt[iterator % dimension_] > (((*ptrNode)->nodeValue).first)[iterator % dimension_]]))
-      {iterator++;}
+bool KDTree<N, ElemType>::find(const Point<N>& pt, node_type**& ptrNode) const {
+  size_t axis = 0;
+  ptrNode = const_cast<node_type**> (&headNode);
+  for ( ; *ptrNode and (*ptrNode)->nodePoint != pt; axis = nextAxis(axis))
+    ptrNode = &((*ptrNode)->nextNodes[pt[axis] > ((*ptrNode)->nodePoint)[axis]]);
   return *ptrNode != 0;
 }
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::find_batch(const Point<N>* pts, size_t count, node_type** nodes) const {
+  if (hashIndex_) {
+    for (size_t i = 0; i < count; i++) nodes[i] = hashIndex_->find(pts[i]);
+    return;
+  }
+  node_type* cursor[kBatchGroup];
+  size_t query[kBatchGroup];
+  size_t axis[kBatchGroup];
+  size_t active = 0;
+  size_t next = 0;
+  // fill the window
+  for ( ; active < kBatchGroup && next < count; ++active, ++next) {
+    cursor[active] = headNode;
+    query[active] = next;
+    axis[active] = 0;
+  }
+  while (active > 0) {
+    for (size_t slot = 0; slot < active; ) {
+      node_type* node = cursor[slot];
+      const Point<N>& pt = pts[query[slot]];
+      if (node == nullptr || node->nodePoint == pt) {
+        // lookup finished: hand the slot to the next pending query
+        nodes[query[slot]] = node;
+        if (next < count) {
+          cursor[slot] = headNode;
+          query[slot] = next++;
+          axis[slot] = 0;
+          ++slot;
+        } else {
+          --active;
+          cursor[slot] = cursor[active];
+          query[slot] = query[active];
+          axis[slot] = axis[active];
+        }
+        continue;
+      }
+      size_t a = axis[slot];
+      node = node->nextNodes[pt[a] > (node->nodePoint)[a]];
+      KDTREE_PREFETCH(node);
+      cursor[slot] = node;
+      axis[slot] = nextAxis(a);
+      ++slot;
+    }
+  }
+}
+
+template <size_t N, typename ElemType>
+vector<bool> KDTree<N, ElemType>::contains_batch(const vector<Point<N>>& pts) const {
+  vector<node_type*> nodes(pts.size());
+  find_batch(pts.data(), pts.size(), nodes.data());
+  vector<bool> result(pts.size());
+  for (size_t i = 0; i < pts.size(); i++) result[i] = nodes[i] != nullptr;
+  return result;
+}
+
+template <size_t N, typename ElemType>
+ElemType& KDTree<N, ElemType>::payload(const node_type* node) {
+  return payloads_[node->payloadIndex];
+}
+
+template <size_t N, typename ElemType>
+const ElemType& KDTree<N, ElemType>::payload(const node_type* node) const {
+  return payloads_[node->payloadIndex];
+}
+
+template <size_t N, typename ElemType>
+uint32_t KDTree<N, ElemType>::addPayload(const ElemType& value) {
+  if (payloads_.size() >= UINT32_MAX) throw length_error("length_error");
+  payloads_.push_back(value);
+  return static_cast<uint32_t>(payloads_.size() - 1);
+}
+
+template <size_t N, typename ElemType>
+typename KDTree<N, ElemType>::node_type* KDTree<N, ElemType>::lookup(const Point<N>& pt) const {
+  if (hashIndex_) return hashIndex_->find(pt);
+  node_type** ptrNode;
+  find(pt, ptrNode);
+  return *ptrNode;
+}
+
+// Returns the node holding pt, creating it with `value` if it is new.
+template <size_t N, typename ElemType>
+typename KDTree<N, ElemType>::node_type* KDTree<N, ElemType>::insertNode(const Point<N>& pt, const ElemType& value, bool& inserted) {
+  inserted = false;
+  if (hashIndex_) {
+    node_type* node = hashIndex_->find(pt);
+    if (node) return node;
+  }
+  node_type** ptrNode;
+  if (!find(pt, ptrNode)) {
+    *ptrNode = pool_.create(pt, addPayload(value));
+    if (hashIndex_) hashIndex_->insert(*ptrNode);
+    size_ +=1;
+    ++generation_;
+    if (boxesEnabled_) growBoxes(*ptrNode);
+    inserted = true;
+  }
+  return *ptrNode;
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::enable_hash_index() {
+  if (hashIndex_) return;
+  hashIndex_.reset(new PointHashIndex<N, node_type>());
+  hashIndex_->reserve(size_);
+  vector<node_type*> stack;
+  if (headNode) stack.push_back(headNode);
+  while (!stack.empty()) {
+    node_type* node = stack.back();
+    stack.pop_back();
+    hashIndex_->insert(node);
+    for (size_t side = 0; side < 2; side++)
+      if (node->nextNodes[side]) stack.push_back(node->nextNodes[side]);
+  }
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::disable_hash_index() {
+  hashIndex_.reset();
+}
+
+template <size_t N, typename ElemType>
+bool KDTree<N, ElemType>::hash_index_enabled() const {
+  return hashIndex_ != nullptr;
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::enable_bounding_boxes() {
+  boxesEnabled_ = true;
+  boxes_.clear();
+  boxes_.reserve(size_);
+  if (headNode) buildBoxes(headNode);
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::disable_bounding_boxes() {
+  boxesEnabled_ = false;
+  vector<KDTreeBox<N>>().swap(boxes_);
+}
+
+template <size_t N, typename ElemType>
+bool KDTree<N, ElemType>::bounding_boxes_enabled() const {
+  return boxesEnabled_;
+}
+
+// Assigns boxes to the subtree bottom-up and returns the root's box.
+template <size_t N, typename ElemType>
+uint32_t KDTree<N, ElemType>::buildBoxes(node_type* node) {
+  uint32_t index = static_cast<uint32_t>(boxes_.size());
+  node->boxIndex = index;
+  KDTreeBox<N> box = {node->nodePoint, node->nodePoint};
+  boxes_.push_back(box);
+  for (size_t side = 0; side < 2; side++) {
+    if (!node->nextNodes[side]) continue;
+    uint32_t child = buildBoxes(node->nextNodes[side]);
+    for (size_t i = 0; i < N; i++) {
+      boxes_[index].lo[i] = min(boxes_[index].lo[i], boxes_[child].lo[i]);
+      boxes_[index].hi[i] = max(boxes_[index].hi[i], boxes_[child].hi[i]);
+    }
+  }
+  return index;
+}
+
+// Gives a freshly linked node its box and widens its ancestors' boxes.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::growBoxes(node_type* node) {
+  const Point<N>& pt = node->nodePoint;
+  node->boxIndex = static_cast<uint32_t>(boxes_.size());
+  KDTreeBox<N> box = {pt, pt};
+  boxes_.push_back(box);
+  widenAncestors(node);
+}
+
+// Widens the boxes on the path from the root to the node by its box.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::widenAncestors(node_type* node) {
+  const Point<N>& pt = node->nodePoint;
+  KDTreeBox<N> box = boxes_[node->boxIndex];
+  size_t axis = 0;
+  for (node_type* cursor = headNode; cursor != node; axis = nextAxis(axis)) {
+    KDTreeBox<N>& bounds = boxes_[cursor->boxIndex];
+    for (size_t i = 0; i < N; i++) {
+      bounds.lo[i] = min(bounds.lo[i], box.lo[i]);
+      bounds.hi[i] = max(bounds.hi[i], box.hi[i]);
+    }
+    cursor = cursor->nextNodes[pt[axis] > cursor->nodePoint[axis]];
+  }
+}
+
+template <size_t N, typename ElemType>
+double KDTree<N, ElemType>::boxDistance(const node_type* node, const Point<N>& key) const {
+  const KDTreeBox<N>& box = boxes_[node->boxIndex];
+  double result = 0.0;
+  for (size_t i = 0; i < N; i++) {
+    double gap = max(box.lo[i] - key[i], key[i] - box.hi[i]);
+    if (gap > 0) result += gap * gap;
+  }
+  return result;
+}
+
+// Squared distance from key to the farthest corner of the node's box.
+template <size_t N, typename ElemType>
+double KDTree<N, ElemType>::boxFarDistance(const node_type* node, const Point<N>& key) const {
+  const KDTreeBox<N>& box = boxes_[node->boxIndex];
+  double result = 0.0;
+  for (size_t i = 0; i < N; i++) {
+    double gap = max(key[i] - box.lo[i], box.hi[i] - key[i]);
+    result += gap * gap;
+  }
+  return result;
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::emitSubtree(const Point<N>& key, const node_type* node, vector<pair<double, uint32_t>>& found) const {
+  for ( ; node; node = node->nextNodes[1]) {
+    found.push_back(make_pair(squared_distance(node->nodePoint, key), node->payloadIndex));
+    emitSubtree(key, node->nextNodes[0], found);
+  }
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::emitSubtree(const node_type* node, vector<uint32_t>& found) const {
+  for ( ; node; node = node->nextNodes[1]) {
+    found.push_back(node->payloadIndex);
+    emitSubtree(node->nextNodes[0], found);
+  }
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::enable_query_cache(size_t capacity, double quantum) {
+  queryCache_.reset(new KNNQueryCache<N>(capacity, quantum, generation_));
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::disable_query_cache() {
+  queryCache_.reset();
+}
+
+template <size_t N, typename ElemType>
+bool KDTree<N, ElemType>::query_cache_enabled() const {
+  return queryCache_ != nullptr;
+}
+
+template <size_t N, typename ElemType>
+QueryCacheStats KDTree<N, ElemType>::query_cache_stats() const {
+  return queryCache_ ? queryCache_->stats() : QueryCacheStats();
+}
 //endfunctions
 
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>::KDTree() {
-  dimension_ = N;
   size_ = 0;
 }
 
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>::~KDTree() {
-  killNodes(headNode);
+  pool_.clear();
   headNode=nullptr;
 }
 
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>::KDTree(const KDTree& rhs) {
-  headNode = initNode(rhs.headNode);
-  dimension_ = rhs.dimension_;
+  pool_.reserve(rhs.size_);
+  headNode = initNode(rhs.headNode, pool_);
+  payloads_ = rhs.payloads_;
   size_ = rhs.size_;
+  if (rhs.hashIndex_) enable_hash_index();
+  if (rhs.queryCache_)
+    enable_query_cache(rhs.queryCache_->capacity(), rhs.queryCache_->quantum());
+  if (rhs.boxesEnabled_) enable_bounding_boxes();
 }
 
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>& KDTree<N, ElemType>::operator=(const KDTree& rhs) {
-  headNode = initNode(rhs.headNode);
-  dimension_ = rhs.dimension_;
+  if (this == &rhs) return *this;
+  pool_.clear();
+  pool_.reserve(rhs.size_);
+  headNode = initNode(rhs.headNode, pool_);
+  payloads_ = rhs.payloads_;
   size_ = rhs.size_;
+  hashIndex_.reset();
+  if (rhs.hashIndex_) enable_hash_index();
+  ++generation_;
+  queryCache_.reset();
+  if (rhs.queryCache_)
+    enable_query_cache(rhs.queryCache_->capacity(), rhs.queryCache_->quantum());
+  if (rhs.boxesEnabled_) enable_bounding_boxes();
+  else disable_bounding_boxes();
   return *this;
 }
 
 template <size_t N, typename ElemType>
 size_t KDTree<N, ElemType>::dimension() const {
-  return dimension_;
+  return N;
 }
 
 template <size_t N, typename ElemType>
@@ -145,67 +635,494 @@ bool KDTree<N, ElemType>::empty() const {
 
 template <size_t N, typename ElemType>
 bool KDTree<N, ElemType>::contains(const Point<N>& pt) const {
-  KDTreeNode<value_type>** ptrNode;
-  if (!find(pt, ptrNode)) return false;
-  else return true;
+  return lookup(pt) != nullptr;
 }
 template <size_t N, typename ElemType>
 void KDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value) {
-  KDTreeNode<value_type>** ptrNode;
-  if (!find(pt, ptrNode)) {
-    value_type valueNew;
-    valueNew.first = pt;
-    valueNew.second = value;
-    *ptrNode = new KDTreeNode<value_type>(valueNew);
-    size_ +=1;
-  }
-  ((*ptrNode)->nodeValue).second = value;
+  bool inserted;
+  node_type* node = insertNode(pt, value, inserted);
+  if (!inserted) payloads_[node->payloadIndex] = value;
 }
 
 template <size_t N, typename ElemType>
 ElemType& KDTree<N, ElemType>::operator[](const Point<N>& pt) {
-  KDTreeNode<value_type>** ptrNode;
-  if (!find(pt, ptrNode)) {
-    value_type valueNew;
-    valueNew.first = pt;
-    valueNew.second = size_;
-    *ptrNode = new KDTreeNode<value_type>(valueNew);
-    return ((*ptrNode)->nodeValue).second;
-  }
-  return ((*ptrNode)->nodeValue).second;
+  bool inserted;
+  return payloads_[insertNode(pt, ElemType(), inserted)->payloadIndex];
 }
 
 template <size_t N, typename ElemType>
 ElemType& KDTree<N, ElemType>::at(const Point<N>& pt){
-  KDTreeNode<value_type>** ptrNode;
-  if (find(pt, ptrNode))
-      return ((*ptrNode)->nodeValue).second;
+  node_type* node = lookup(pt);
+  if (node)
+      return payloads_[node->payloadIndex];
   throw out_of_range("out_of_range");
 }
 
 template <size_t N, typename ElemType>
 const ElemType& KDTree<N, ElemType>::at(const Point<N>& pt) const{
-  at(pt);
+  node_type* node = lookup(pt);
+  if (node)
+      return payloads_[node->payloadIndex];
+  throw out_of_range("out_of_range");
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::bulk_load(KDTreeStaging<N, ElemType>& staging) {
+  insertBatch(staging.points, staging.values);
+  staging.clear();
+}
+
+template <size_t N, typename ElemType>
+template <typename InputIt>
+void KDTree<N, ElemType>::insert_batch(InputIt first, InputIt last) {
+  vector<Point<N>> points;
+  vector<ElemType> values;
+  for ( ; first != last; ++first) {
+    const value_type& item = *first;
+    points.push_back(item.first);
+    values.push_back(item.second);
+  }
+  insertBatch(points, values);
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::insertBatch(const vector<Point<N>>& points, const vector<ElemType>& values) {
+  size_t count = points.size();
+  // group equal points, each group in batch order; sorting copies of the
+  // points rather than indices into `points` keeps the comparisons local
+  vector<BatchEntry> sorted(count);
+  for (size_t i = 0; i < count; i++) {
+    BatchEntry entry = {points[i], i, i, 0};
+    sorted[i] = entry;
+  }
+  sort(sorted.begin(), sorted.end(), [](const BatchEntry& a, const BatchEntry& b) {
+    if (a.point != b.point)
+      return lexicographical_compare(a.point.begin(), a.point.end(), b.point.begin(), b.point.end());
+    return a.first < b.first;
+  });
+  // one entry per distinct point: first occurrence names it, last one's value wins
+  vector<BatchEntry> entries;
+  for (size_t i = 0; i < count; ) {
+    size_t j = i + 1;
+    while (j < count && sorted[j].point == sorted[i].point) j++;
+    sorted[i].last = sorted[j - 1].first;
+    entries.push_back(sorted[i]);
+    i = j;
+  }
+  vector<BatchEntry>().swap(sorted);
+
+  vector<BatchTarget> targets, walks;
+  routeBatch(&headNode, 0, entries.data(), entries.data() + entries.size(), values, targets, walks);
+  descendBatch(walks, values, targets);
+
+  // new points get ids in order of first occurrence, as single inserts would
+  vector<BatchEntry*> byFirst(count, nullptr);
+  size_t fresh = 0;
+  for (size_t t = 0; t < targets.size(); t++)
+    for (BatchEntry* e = targets[t].begin; e != targets[t].end; e++, fresh++)
+      byFirst[e->first] = e;
+  for (size_t i = 0; i < count; i++)
+    if (byFirst[i]) byFirst[i]->id = addPayload(values[byFirst[i]->last]);
+  vector<BatchEntry*>().swap(byFirst);
+  if (hashIndex_) hashIndex_->reserve(size_ + fresh);
+
+  // nodes of the batch come from one block, laid out target by target
+  pool_.reserve(fresh);
+  vector<BuildEntry> scratch;
+  for (size_t t = 0; t < targets.size(); t++) {
+    BatchTarget& target = targets[t];
+    scratch.clear();
+    for (BatchEntry* e = target.begin; e != target.end; e++) {
+      scratch.push_back(make_pair(e->point, pool_.create(e->point, e->id)));
+      if (hashIndex_) hashIndex_->insert(scratch.back().second);
+    }
+    target.root = buildBalanced(scratch.data(), scratch.data() + scratch.size(), target.depth % N);
+    *target.slot = target.root;
+    if (boxesEnabled_) {
+      buildBoxes(target.root);
+      widenAncestors(target.root);
+    }
+  }
+  size_ += fresh;
+  if (fresh) ++generation_;
+
+  // a balanced group of g nodes at depth d ends at depth d + floor(log2 g);
+  // only groups past the height bound are looked at again
+  double bound = log(static_cast<double>(size_)) / log(1 / kBatchBalance);
+  for (size_t t = 0; t < targets.size(); t++) {
+    const BatchTarget& target = targets[t];
+    size_t group = target.end - target.begin;
+    size_t height = target.depth;
+    while (group >>= 1) height++;
+    if (height > bound) rebalanceAbove(target.root, bound, scratch);
+  }
+  // rebuilt subtrees leave their old boxes behind
+  if (boxesEnabled_ && boxes_.size() > 2 * size_) enable_bounding_boxes();
+}
+
+// Splits a batch group by the node's plane, like find, down to empty slots.
+// Groups down to a single point are left in `walks` for descendBatch.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::routeBatch(node_type** slot, size_t depth, BatchEntry* begin, BatchEntry* end, const vector<ElemType>& values, vector<BatchTarget>& targets, vector<BatchTarget>& walks) {
+  if (begin == end) return;
+  node_type* node = *slot;
+  BatchTarget target = {slot, depth, begin, end, nullptr};
+  if (node == nullptr || end - begin == 1) {
+    (node ? walks : targets).push_back(target);
+    return;
+  }
+  size_t axis = depth % N;
+  double split = node->nodePoint[axis];
+  BatchEntry* mid = partition(begin, end, [axis, split](const BatchEntry& e) {
+    return !(e.point[axis] > split);
+  });
+  // the point already at this node, if any, is on the left and only gets
+  // its value updated
+  for (BatchEntry* e = begin; e != mid; e++) {
+    if (e->point == node->nodePoint) {
+      payloads_[node->payloadIndex] = values[e->last];
+      *e = *begin++;
+      break;
+    }
+  }
+  routeBatch(&node->nextNodes[0], depth + 1, begin, mid, values, targets, walks);
+  routeBatch(&node->nextNodes[1], depth + 1, mid, end, values, targets, walks);
+}
+
+// Finishes single-point groups with interleaved descents, as find_batch
+// does, so their cache misses overlap. A walk that meets its point updates
+// the value; one that reaches an empty slot becomes a target.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::descendBatch(vector<BatchTarget>& walks, const vector<ElemType>& values, vector<BatchTarget>& targets) {
+  size_t window[kBatchGroup];
+  size_t active = 0;
+  size_t next = 0;
+  for ( ; active < kBatchGroup && next < walks.size(); ++active, ++next) window[active] = next;
+  while (active > 0) {
+    for (size_t slot = 0; slot < active; ) {
+      BatchTarget& walk = walks[window[slot]];
+      node_type* node = *walk.slot;
+      const Point<N>& pt = walk.begin->point;
+      if (node == nullptr || node->nodePoint == pt) {
+        if (node) payloads_[node->payloadIndex] = values[walk.begin->last];
+        else targets.push_back(walk);
+        if (next < walks.size()) window[slot++] = next++;
+        else window[slot] = window[--active];
+        continue;
+      }
+      size_t axis = walk.depth % N;
+      walk.slot = &node->nextNodes[pt[axis] > node->nodePoint[axis]];
+      walk.depth++;
+      KDTREE_PREFETCH(*walk.slot);
+      ++slot;
+    }
+  }
+}
+
+// Scapegoat step for a batch subtree that may end deeper than `bound`:
+// walks its ancestors upward, counting the sibling sides, and rebuilds
+// the first one with a child over kBatchBalance of its size. The subtree
+// is measured again, as an earlier rebuild may have taken it in.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::rebalanceAbove(const node_type* node, double bound, vector<BuildEntry>& scratch) {
+  vector<node_type**> path;
+  node_type** slot = &headNode;
+  for (size_t axis = 0; *slot != node; axis = nextAxis(axis)) {
+    path.push_back(slot);
+    slot = &(*slot)->nextNodes[node->nodePoint[axis] > (*slot)->nodePoint[axis]];
+  }
+  size_t childSize = countNodes(node);
+  size_t height = path.size();
+  for (size_t rest = childSize; rest >>= 1; ) height++;
+  if (height <= bound) return;
+  for (size_t i = path.size(); i-- > 0; ) {
+    node_type* ancestor = *path[i];
+    size_t sibling = countNodes(ancestor->nextNodes[ancestor->nextNodes[0] == node]);
+    size_t size = childSize + sibling + 1;
+    if (childSize > kBatchBalance * size || sibling > kBatchBalance * size) {
+      scratch.clear();
+      collectNodes(ancestor, scratch);
+      *path[i] = buildBalanced(scratch.data(), scratch.data() + scratch.size(), i % N);
+      if (boxesEnabled_) buildBoxes(*path[i]);
+      return;
+    }
+    node = ancestor;
+    childSize = size;
+  }
+}
+
+template <size_t N, typename ElemType>
+size_t KDTree<N, ElemType>::countNodes(const node_type* node) const {
+  size_t count = 0;
+  for ( ; node; node = node->nextNodes[1])
+    count += 1 + countNodes(node->nextNodes[0]);
+  return count;
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::collectNodes(node_type* node, vector<BuildEntry>& nodes) const {
+  for ( ; node; node = node->nextNodes[1]) {
+    nodes.push_back(make_pair(node->nodePoint, node));
+    collectNodes(node->nextNodes[0], nodes);
+  }
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::export_to(KDTreeStaging<N, ElemType>& staging) const {
+  staging.points.resize(size_);
+  staging.values.assign(payloads_.begin(), payloads_.end());
+  vector<const node_type*> stack;
+  if (headNode) stack.push_back(headNode);
+  while (!stack.empty()) {
+    const node_type* node = stack.back();
+    stack.pop_back();
+    staging.points[node->payloadIndex] = node->nodePoint;
+    for (size_t side = 0; side < 2; side++)
+      if (node->nextNodes[side]) stack.push_back(node->nextNodes[side]);
+  }
+}
+
+// Median split on `axis` that relinks the given nodes; points equal to the
+// median go left, as find expects. Points are copied next to their nodes
+// so the selection does not chase pointers.
+template <size_t N, typename ElemType>
+typename KDTree<N, ElemType>::node_type* KDTree<N, ElemType>::buildBalanced(BuildEntry* begin, BuildEntry* end, size_t axis) {
+  if (begin == end) return nullptr;
+  auto byAxis = [axis](const BuildEntry& a, const BuildEntry& b) {
+    return a.first[axis] < b.first[axis];
+  };
+  BuildEntry* mid = begin + (end - begin) / 2;
+  nth_element(begin, mid, end, byAxis);
+  double split = mid->first[axis];
+  BuildEntry* right = partition(mid + 1, end, [axis, split](const BuildEntry& e) {
+    return !(e.first[axis] > split);
+  });
+  swap(*mid, *(right - 1));
+  mid = right - 1;
+  node_type* node = mid->second;
+  node->nextNodes[0] = buildBalanced(begin, mid, nextAxis(axis));
+  node->nextNodes[1] = buildBalanced(right, end, nextAxis(axis));
+  return node;
 }
 
 //KNN_generic
+// Depth-first search keeping the k best (squared distance, payload index)
+// in a max-heap; the far side of a split is skipped once the splitting
+// plane is farther than the current k-th candidate. Payloads are not touched.
 template <size_t N, typename ElemType>
-void KDTree<N, ElemType>::knnIterator(Point<N> key, KDTreeNode<value_type>* tempNode, vector<pair<ElemType,double>>& vecContent,int level) const{
+void KDTree<N, ElemType>::knnIterator(const Point<N>& key, const node_type* tempNode, size_t axis, size_t k, vector<pair<double, uint32_t>>& vecContent) const{
   if (tempNode == nullptr) return; 
-  double kdDistance = distance((tempNode->nodeValue).first, key);
-  vecContent.push_back(make_pair((tempNode->nodeValue).second, kdDistance));
-  knnIterator(key, (tempNode->nextNodes)[0], vecContent,++level);
-  knnIterator(key, (tempNode->nextNodes)[1], vecContent,++level);
+  if (boxesEnabled_ && vecContent.size() == k && boxDistance(tempNode, key) > vecContent.front().first)
+    return;
+  pair<double, uint32_t> candidate(squared_distance(tempNode->nodePoint, key), tempNode->payloadIndex);
+  offerCandidate(vecContent, k, candidate);
+  double gap = key[axis] - (tempNode->nodePoint)[axis];
+  bool near = gap > 0;
+  knnIterator(key, (tempNode->nextNodes)[near], nextAxis(axis), k, vecContent);
+  // equal distances are still visited: a smaller id wins the tie
+  if (vecContent.size() < k || gap * gap <= vecContent.front().first)
+    knnIterator(key, (tempNode->nextNodes)[!near], nextAxis(axis), k, vecContent);
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::offerCandidate(vector<pair<double, uint32_t>>& heap, size_t k, const pair<double, uint32_t>& candidate) {
+  if (heap.size() < k) {
+    heap.push_back(candidate);
+    push_heap(heap.begin(), heap.end());
+  } else if (candidate < heap.front()) {
+    pop_heap(heap.begin(), heap.end());
+    heap.back() = candidate;
+    push_heap(heap.begin(), heap.end());
+  }
+}
+
+// knnIterator with an explicit stack, stopping after `budget` visited
+// nodes so the search can resume later. Same visiting order; a far side
+// also keeps its ancestors' plane bounds, so it can only prune more.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::knnSteps(const Point<N>& key, size_t k, size_t budget, vector<KNNFrame>& stack, vector<pair<double, uint32_t>>& heap) const {
+  for (size_t visited = 0; visited < budget && !stack.empty(); ) {
+    KNNFrame frame = stack.back();
+    stack.pop_back();
+    const node_type* node = frame.node;
+    if (heap.size() == k) {
+      // equal distances are still visited: a smaller id wins the tie
+      if (frame.bound > heap.front().first) continue;
+      if (boxesEnabled_ && boxDistance(node, key) > heap.front().first) continue;
+    }
+    ++visited;
+    offerCandidate(heap, k, make_pair(squared_distance(node->nodePoint, key), node->payloadIndex));
+    double gap = key[frame.axis] - (node->nodePoint)[frame.axis];
+    bool near = gap > 0;
+    size_t axis = nextAxis(frame.axis);
+    if (node->nextNodes[!near]) {
+      KNNFrame far = {node->nextNodes[!near], axis, max(frame.bound, gap * gap)};
+      stack.push_back(far);
+    }
+    if (node->nextNodes[near]) {
+      KNNFrame next = {node->nextNodes[near], axis, frame.bound};
+      stack.push_back(next);
+    }
+  }
+}
+
+template <size_t N, typename ElemType>
+struct KDTree<N, ElemType>::KNNTask {
+  const KDTree* tree;
+  Point<N> key;
+  size_t k;
+  AsyncExecutor executor;
+  KNNCallback done;
+  AsyncQueryOptions options;
+  vector<KNNFrame> stack;
+  vector<pair<double, uint32_t>> heap;
+  // slices requested and not yet taken up; nonzero while one is running
+  atomic<unsigned> requests{0};
+};
+
+// Runs slices: stop if cancelled or late, otherwise search and either
+// resubmit the rest or deliver the result. A slice submitted while this
+// one is still in the executor, inline or from another thread, only
+// counts a request; the running call then takes it up in its loop.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::runKNNTask(const shared_ptr<KNNTask>& task) {
+  KNNTask& t = *task;
+  if (t.requests.fetch_add(1) != 0) return;
+  AsyncStatus status = AsyncStatus::kDone;
+  for (;;) {
+    if (t.options.token.cancelled()) {
+      status = AsyncStatus::kCancelled;
+      break;
+    }
+    if (chrono::steady_clock::now() >= t.options.deadline) {
+      status = AsyncStatus::kDeadlineExceeded;
+      break;
+    }
+    t.tree->knnSteps(t.key, t.k, max<size_t>(t.options.slice_nodes, 1), t.stack, t.heap);
+    if (t.stack.empty()) break;
+    shared_ptr<KNNTask> next = task;
+    t.executor([next]() { runKNNTask(next); });
+    // 1: the next slice is still pending and will start a new call
+    if (t.requests.fetch_sub(1) == 1) return;
+  }
+  sort_heap(t.heap.begin(), t.heap.end());
+  t.done(status, std::move(t.heap));
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::knn_search_async(const Point<N>& key, size_t k, const AsyncExecutor& executor, KNNCallback done,
+                                           const AsyncQueryOptions& options) const {
+  shared_ptr<KNNTask> task(new KNNTask());
+  task->tree = this;
+  task->key = key;
+  task->k = min(k, size_);
+  task->executor = executor;
+  task->done = std::move(done);
+  task->options = options;
+  if (headNode && task->k > 0) {
+    KNNFrame root = {headNode, 0, 0.0};
+    task->stack.push_back(root);
+    task->heap.reserve(task->k);
+  }
+  executor([task]() { runKNNTask(task); });
+}
+
+template <size_t N, typename ElemType>
+vector<pair<double, uint32_t>> KDTree<N, ElemType>::knn_search(const Point<N>& key, size_t k) const{
+  if (!queryCache_) return knnSearch(key, k);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<pair<double, uint32_t>> result;
+  bool hit = queryCache_->lookup(key, k, generation_, result);
+  if (!hit) {
+    result = knnSearch(key, k);
+    queryCache_->store(key, k, generation_, result);
+  }
+  chrono::nanoseconds elapsed = chrono::steady_clock::now() - start;
+  queryCache_->record(hit, elapsed.count());
+  return result;
+}
+
+template <size_t N, typename ElemType>
+vector<pair<double, uint32_t>> KDTree<N, ElemType>::knnSearch(const Point<N>& key, size_t k) const{
+  vector<pair<double, uint32_t>> vecContent;
+  if (k > size_) k = size_;
+  if (k == 0) return vecContent;
+  vecContent.reserve(k);
+  knnIterator(key, headNode, 0, k, vecContent);
+  sort_heap(vecContent.begin(), vecContent.end());
+  return vecContent;
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::radiusIterator(const Point<N>& key, const node_type* node, size_t axis, double bound, vector<pair<double, uint32_t>>& found) const {
+  if (node == nullptr) return;
+  if (boxesEnabled_) {
+    if (boxDistance(node, key) > bound) return;
+    if (boxFarDistance(node, key) <= bound) {
+      emitSubtree(key, node, found);
+      return;
+    }
+  }
+  double dist = squared_distance(node->nodePoint, key);
+  if (dist <= bound) found.push_back(make_pair(dist, node->payloadIndex));
+  double gap = key[axis] - (node->nodePoint)[axis];
+  if (gap <= 0 || gap * gap <= bound) radiusIterator(key, node->nextNodes[0], nextAxis(axis), bound, found);
+  if (gap > 0 || gap * gap <= bound) radiusIterator(key, node->nextNodes[1], nextAxis(axis), bound, found);
+}
+
+template <size_t N, typename ElemType>
+vector<pair<double, uint32_t>> KDTree<N, ElemType>::radius_search(const Point<N>& key, double radius) const {
+  vector<pair<double, uint32_t>> found;
+  radiusIterator(key, headNode, 0, radius * radius, found);
+  sort(found.begin(), found.end());
+  return found;
+}
+
+// Left subtrees hold coordinates <= the split, so the left side can only
+// be skipped when the box starts above it.
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::boxIterator(const Point<N>& lo, const Point<N>& hi, const node_type* node, size_t axis, vector<uint32_t>& found) const {
+  if (node == nullptr) return;
+  if (boxesEnabled_) {
+    const KDTreeBox<N>& box = boxes_[node->boxIndex];
+    bool covered = true;
+    for (size_t i = 0; i < N; i++) {
+      if (box.hi[i] < lo[i] || hi[i] < box.lo[i]) return;
+      covered = covered && lo[i] <= box.lo[i] && box.hi[i] <= hi[i];
+    }
+    if (covered) {
+      emitSubtree(node, found);
+      return;
+    }
+  }
+  bool inside = true;
+  for (size_t i = 0; i < N; i++)
+    inside = inside && lo[i] <= node->nodePoint[i] && node->nodePoint[i] <= hi[i];
+  if (inside) found.push_back(node->payloadIndex);
+  double split = node->nodePoint[axis];
+  if (lo[axis] <= split) boxIterator(lo, hi, node->nextNodes[0], nextAxis(axis), found);
+  if (hi[axis] > split) boxIterator(lo, hi, node->nextNodes[1], nextAxis(axis), found);
+}
+
+template <size_t N, typename ElemType>
+vector<uint32_t> KDTree<N, ElemType>::box_search(const Point<N>& lo, const Point<N>& hi) const {
+  vector<uint32_t> found;
+  boxIterator(lo, hi, headNode, 0, found);
+  sort(found.begin(), found.end());
+  return found;
+}
+
+template <size_t N, typename ElemType>
+const ElemType& KDTree<N, ElemType>::payload_by_id(size_t id) const {
+  return payloads_[id];
 }
 
 template <size_t N, typename ElemType>
 vector<ElemType> KDTree<N, ElemType>::knn_query(const Point<N>& key, size_t k) const{
-    vector<pair<ElemType,double>> vecContent;
+    vector<pair<double, uint32_t>> vecContent = knn_search(key, k);
     vector<ElemType> query;
-    KDTreeNode<value_type>* tempNode = headNode;
-    knnIterator(key, tempNode, vecContent,0);
-    sort(vecContent.begin(), vecContent.end(), [](const auto& x, const auto& y) { return x.second < y.second; });
-    for (size_t i = 0; i < k; i++) query.push_back(vecContent[i].first);
+    query.reserve(vecContent.size());
+    for (size_t i = 0; i < vecContent.size(); i++) query.push_back(payloads_[vecContent[i].second]);
 
     return query;
 }
@@ -213,12 +1130,12 @@ vector<ElemType> KDTree<N, ElemType>::knn_query(const Point<N>& key, size_t k) c
 template <size_t N, typename ElemType>
 ElemType KDTree<N, ElemType>::knn_value(const Point<N>& key, size_t k) const {
   if (k > size_) k = size_;
+  if (k == 0) throw out_of_range("out_of_range");
   bool condition;
   vector<ElemType> values(k);
   values = knn_query(key, k);
   vector<ElemType> vecET;
   vector<pair<ElemType,size_t>> vecET_S;
-  pair<ElemType, size_t> top = vecET_S[0];
   vecET.push_back(values[0]);
   for (size_t i = 1; i < k; i++) {
     condition = false;
@@ -237,6 +1154,7 @@ ElemType KDTree<N, ElemType>::knn_value(const Point<N>& key, size_t k) const {
     }
   }
   //top pair 
+  pair<ElemType, size_t> top = vecET_S[0];
   for (size_t i = 1; i < vecET_S.size(); i++) {
     if (top.second < vecET_S[i].second)
       top = vecET_S[i];
@@ -244,4 +1162,23 @@ ElemType KDTree<N, ElemType>::knn_value(const Point<N>& key, size_t k) const {
   return top.first;
 }
 
-#endif  // SRC_KDTREE_HPP_
\ No newline at end of file
+template <size_t N, typename ElemType>
+KNNGraph KDTree<N, ElemType>::all_knn(size_t k, size_t threads) const {
+  vector<Point<N>> points;
+  vector<uint32_t> ids;
+  points.reserve(size_);
+  ids.reserve(size_);
+  vector<const node_type*> stack;
+  if (headNode) stack.push_back(headNode);
+  while (!stack.empty()) {
+    const node_type* node = stack.back();
+    stack.pop_back();
+    points.push_back(node->nodePoint);
+    ids.push_back(node->payloadIndex);
+    for (size_t side = 0; side < 2; side++)
+      if (node->nextNodes[side]) stack.push_back(node->nextNodes[side]);
+  }
+  return DualTreeKNN<N>(points, ids, k).run(threads);
+}
+
+#endif  // SRC_KDTREE_HPP_
@@ -0,0 +1,103 @@
+// Copyright
+
+#ifndef SRC_LATENCYHISTOGRAM_HPP_
+#define SRC_LATENCYHISTOGRAM_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Log-linear latency histogram in the style of HdrHistogram: values below
+// 2 * kSubBuckets are counted exactly, larger ones in kSubBuckets linear
+// buckets per power of two, so any recorded value is reported within
+// 1 / kSubBuckets (under 1%) of itself. Recording is a shift and an
+// increment; histograms of separate threads are combined with merge.
+class LatencyHistogram {
+ public:
+  static const unsigned kSubBucketBits = 7;
+  static const uint64_t kSubBuckets = 1ULL << kSubBucketBits;
+
+  LatencyHistogram()
+      : counts_(bucketIndex(std::numeric_limits<uint64_t>::max()) + 1, 0),
+        count_(0),
+        sum_(0),
+        min_(std::numeric_limits<uint64_t>::max()),
+        max_(0) {}
+
+  void record(uint64_t value) {
+    ++counts_[bucketIndex(value)];
+    ++count_;
+    sum_ += value;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  void clear() { *this = LatencyHistogram(); }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const {
+    return count_ ? static_cast<double>(sum_) / count_ : 0.0;
+  }
+
+  // Smallest recorded bucket bound that at least `percentile` percent of
+  // the values do not exceed, clamped to the recorded maximum.
+  uint64_t value_at_percentile(double percentile) const {
+    if (count_ == 0) return 0;
+    double wanted = percentile / 100.0 * count_;
+    uint64_t target = wanted < 1.0 ? 1 : static_cast<uint64_t>(wanted);
+    if (static_cast<double>(target) < wanted) ++target;
+    if (target > count_) target = count_;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= target) return std::min(highestInBucket(i), max_);
+    }
+    return max_;
+  }
+
+ private:
+  static unsigned highestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    unsigned bit = 0;
+    while (value >>= 1) ++bit;
+    return bit;
+#endif
+  }
+
+  // Buckets [0, 2 * kSubBuckets) hold their value; above that, bucket
+  // kSubBuckets * shift + (value >> shift) covers the values sharing the
+  // top kSubBucketBits + 1 bits.
+  static size_t bucketIndex(uint64_t value) {
+    if (value < 2 * kSubBuckets) return static_cast<size_t>(value);
+    unsigned shift = highestBit(value) - kSubBucketBits;
+    return static_cast<size_t>(kSubBuckets * shift + (value >> shift));
+  }
+
+  static uint64_t highestInBucket(size_t index) {
+    if (index < 2 * kSubBuckets) return index;
+    uint64_t shift = index / kSubBuckets - 1;
+    uint64_t top = index % kSubBuckets + kSubBuckets;
+    return ((top + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+};
+
+#endif  // SRC_LATENCYHISTOGRAM_HPP_
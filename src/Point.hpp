@@ -38,12 +38,105 @@ class Point {
 template <size_t N>
 double distance(const Point<N>& one, const Point<N>& two);
 
+template <size_t N>
+double squared_distance(const Point<N>& one, const Point<N>& two);
+
 template <size_t N>
 bool operator==(const Point<N>& one, const Point<N>& two);
 
 template <size_t N>
 bool operator!=(const Point<N>& one, const Point<N>& two);
 
+/** Coordinate kernels */
+
+// Plain loops over the coordinates; kept as the reference implementation.
+template <size_t N>
+struct GenericPointKernel {
+  static double squaredDistance(const double* one, const double* two) {
+    double result = 0.0;
+    for (size_t i = 0; i < N; ++i) {
+      result += (one[i] - two[i]) * (one[i] - two[i]);
+    }
+    return result;
+  }
+  static bool equal(const double* one, const double* two) {
+    for (size_t i = 0; i < N; ++i) {
+      if (one[i] != two[i]) return false;
+    }
+    return true;
+  }
+};
+
+// Compile-time unrolling of the kernels over coordinates [I, N).
+template <size_t I, size_t N>
+struct UnrolledPointKernel {
+  static double squaredDistance(const double* one, const double* two) {
+    double delta = one[I] - two[I];
+    return delta * delta +
+           UnrolledPointKernel<I + 1, N>::squaredDistance(one, two);
+  }
+  static bool equal(const double* one, const double* two) {
+    return one[I] == two[I] && UnrolledPointKernel<I + 1, N>::equal(one, two);
+  }
+};
+
+template <size_t N>
+struct UnrolledPointKernel<N, N> {
+  static double squaredDistance(const double*, const double*) { return 0.0; }
+  static bool equal(const double*, const double*) { return true; }
+};
+
+// Kernels used by Point and KDTree. Any N is unrolled; the common small
+// dimensions get hand-written fast paths below.
+template <size_t N>
+struct PointKernel : UnrolledPointKernel<0, N> {};
+
+template <>
+struct PointKernel<1> {
+  static double squaredDistance(const double* one, const double* two) {
+    double d0 = one[0] - two[0];
+    return d0 * d0;
+  }
+  static bool equal(const double* one, const double* two) {
+    return one[0] == two[0];
+  }
+};
+
+template <>
+struct PointKernel<2> {
+  static double squaredDistance(const double* one, const double* two) {
+    double d0 = one[0] - two[0], d1 = one[1] - two[1];
+    return d0 * d0 + d1 * d1;
+  }
+  static bool equal(const double* one, const double* two) {
+    return (one[0] == two[0]) & (one[1] == two[1]);
+  }
+};
+
+template <>
+struct PointKernel<3> {
+  static double squaredDistance(const double* one, const double* two) {
+    double d0 = one[0] - two[0], d1 = one[1] - two[1], d2 = one[2] - two[2];
+    return d0 * d0 + d1 * d1 + d2 * d2;
+  }
+  static bool equal(const double* one, const double* two) {
+    return (one[0] == two[0]) & (one[1] == two[1]) & (one[2] == two[2]);
+  }
+};
+
+template <>
+struct PointKernel<4> {
+  static double squaredDistance(const double* one, const double* two) {
+    double d0 = one[0] - two[0], d1 = one[1] - two[1];
+    double d2 = one[2] - two[2], d3 = one[3] - two[3];
+    return (d0 * d0 + d1 * d1) + (d2 * d2 + d3 * d3);
+  }
+  static bool equal(const double* one, const double* two) {
+    return (one[0] == two[0]) & (one[1] == two[1]) & (one[2] == two[2]) &
+           (one[3] == two[3]);
+  }
+};
+
 /** Point class implementation details */
 
 #include <algorithm>
@@ -85,16 +178,17 @@ typename Point<N>::const_iterator Point<N>::end() const {
 
 template <size_t N>
 double distance(const Point<N>& one, const Point<N>& two) {
-  double result = 0.0;
-  for (size_t i = 0; i < N; ++i) {
-    result += (one[i] - two[i]) * (one[i] - two[i]);
-  }
-  return sqrt(result);
+  return sqrt(squared_distance(one, two));
+}
+
+template <size_t N>
+double squared_distance(const Point<N>& one, const Point<N>& two) {
+  return PointKernel<N>::squaredDistance(one.begin(), two.begin());
 }
 
 template <size_t N>
 bool operator==(const Point<N>& one, const Point<N>& two) {
-  return std::equal(one.begin(), one.end(), two.begin());
+  return PointKernel<N>::equal(one.begin(), two.begin());
 }
 
 template <size_t N>
@@ -0,0 +1,120 @@
+// Copyright
+
+#ifndef SRC_POINTHASHINDEX_HPP_
+#define SRC_POINTHASHINDEX_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "Point.hpp"
+
+// Open-addressing (linear probing) hash of points to the tree nodes that
+// hold them, for O(1) exact-match lookups next to a KDTree. Keys are the
+// coordinate bit patterns, with -0.0 folded into 0.0 so that hashing agrees
+// with Point's operator==; the stored node's point is the key, so the index
+// holds no copy of the coordinates.
+template <size_t N, typename Node>
+class PointHashIndex {
+ public:
+  PointHashIndex();
+
+  Node* find(const Point<N>& pt) const;
+  // Adds a node whose point is not in the index yet.
+  void insert(Node* node);
+  void reserve(size_t count);
+  void clear();
+  size_t size() const;
+
+  static uint64_t hashPoint(const Point<N>& pt);
+
+ private:
+  struct Slot {
+    uint64_t hash;
+    Node* node;  // nullptr marks an empty slot
+  };
+
+  void rehash(size_t capacity);
+  void place(uint64_t hash, Node* node);
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  size_t size_;
+};
+
+template <size_t N, typename Node>
+PointHashIndex<N, Node>::PointHashIndex() : mask_(0), size_(0) {
+  rehash(16);
+}
+
+template <size_t N, typename Node>
+uint64_t PointHashIndex<N, Node>::hashPoint(const Point<N>& pt) {
+  uint64_t hash = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < N; ++i) {
+    double coord = pt[i] == 0.0 ? 0.0 : pt[i];
+    uint64_t bits;
+    std::memcpy(&bits, &coord, sizeof(bits));
+    hash = (hash ^ bits) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  // splitmix64 finalizer
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 31);
+}
+
+template <size_t N, typename Node>
+Node* PointHashIndex<N, Node>::find(const Point<N>& pt) const {
+  uint64_t hash = hashPoint(pt);
+  for (size_t i = hash & mask_; slots_[i].node; i = (i + 1) & mask_) {
+    if (slots_[i].hash == hash && slots_[i].node->nodePoint == pt)
+      return slots_[i].node;
+  }
+  return nullptr;
+}
+
+template <size_t N, typename Node>
+void PointHashIndex<N, Node>::insert(Node* node) {
+  // keep the load factor under 0.7
+  if ((size_ + 1) * 10 > slots_.size() * 7) rehash(slots_.size() * 2);
+  place(hashPoint(node->nodePoint), node);
+  ++size_;
+}
+
+template <size_t N, typename Node>
+void PointHashIndex<N, Node>::reserve(size_t count) {
+  size_t capacity = slots_.size();
+  while (count * 10 > capacity * 7) capacity *= 2;
+  if (capacity != slots_.size()) rehash(capacity);
+}
+
+template <size_t N, typename Node>
+void PointHashIndex<N, Node>::clear() {
+  size_ = 0;
+  rehash(16);
+}
+
+template <size_t N, typename Node>
+size_t PointHashIndex<N, Node>::size() const {
+  return size_;
+}
+
+template <size_t N, typename Node>
+void PointHashIndex<N, Node>::place(uint64_t hash, Node* node) {
+  size_t i = hash & mask_;
+  while (slots_[i].node) i = (i + 1) & mask_;
+  slots_[i].hash = hash;
+  slots_[i].node = node;
+}
+
+template <size_t N, typename Node>
+void PointHashIndex<N, Node>::rehash(size_t capacity) {
+  std::vector<Slot> old;
+  old.swap(slots_);
+  Slot empty = {0, nullptr};
+  slots_.assign(capacity, empty);
+  mask_ = capacity - 1;
+  for (size_t i = 0; i < old.size(); ++i)
+    if (old[i].node) place(old[i].hash, old[i].node);
+}
+
+#endif  // SRC_POINTHASHINDEX_HPP_
@@ -0,0 +1,402 @@
+// Copyright
+
+#ifndef SRC_POINTLOADER_HPP_
+#define SRC_POINTLOADER_HPP_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "KDTree.hpp"
+
+// Streaming bulk loader: memory-maps an input file, splits it into chunks
+// parsed by parallel threads straight into a KDTreeStaging buffer, then
+// hands off to KDTree::bulk_load.
+//
+// CSV rows are N coordinates followed by a label, e.g. "1.5,2,-3e2,label".
+// Binary records are N native doubles followed by the raw bytes of a
+// trivially copyable ElemType, back to back with no header.
+
+struct LoaderOptions {
+  size_t threads = 0;  // 0: every hardware thread
+  char delimiter = ',';
+  bool skip_header = false;  // CSV only: ignore the first line
+};
+
+struct LoadStats {
+  size_t bytes = 0;
+  size_t rows = 0;
+  double seconds = 0.0;
+
+  double gigabytes_per_second() const {
+    return seconds > 0 ? bytes / seconds / 1e9 : 0.0;
+  }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const LoadStats& stats) {
+  out << stats.rows << " rows, " << stats.bytes << " bytes in "
+      << stats.seconds << " s (" << stats.gigabytes_per_second() << " GB/s)";
+  return out;
+}
+
+// Read-only private mapping of a whole file.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) : data_(nullptr), size_(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      throw std::runtime_error("cannot stat " + path);
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    if (size_ > 0) {
+      void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("cannot map " + path);
+      }
+      madvise(addr, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(addr);
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if (data_) munmap(const_cast<char*>(data_), size_);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
+/** Field parsers */
+
+// Decimal floating point. Up to 19 significant digits with a power of ten
+// in [-22, 22] are converted exactly with one multiply or divide; anything
+// else (long mantissas, huge exponents, inf/nan) goes through strtod.
+inline bool parseDouble(const char*& p, const char* end, double& out) {
+  static const double kPow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                  1e18, 1e19, 1e20, 1e21, 1e22};
+  while (p < end && (*p == ' ' || *p == '\t')) ++p;
+  const char* start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool exact = true, any = false;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits += mantissa != 0;
+    } else {
+      ++exponent;
+      exact = false;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += mantissa != 0;
+        --exponent;
+      } else {
+        exact = false;
+      }
+    }
+  }
+  if (any && p < end && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    bool negExp = false;
+    if (q < end && (*q == '-' || *q == '+')) negExp = *q++ == '-';
+    if (q < end && *q >= '0' && *q <= '9') {
+      int value = 0;
+      for (; q < end && *q >= '0' && *q <= '9'; ++q)
+        if (value < 100000) value = value * 10 + (*q - '0');
+      exponent += negExp ? -value : value;
+      p = q;
+    }
+  }
+  if (any && exact && mantissa <= (1ULL << 53) && exponent >= -22 &&
+      exponent <= 22) {
+    double value = static_cast<double>(mantissa);
+    value = exponent < 0 ? value / kPow10[-exponent] : value * kPow10[exponent];
+    out = negative ? -value : value;
+    return true;
+  }
+  // slow path: copy the token so strtod cannot run past the field
+  const char* tokenEnd = start;
+  while (tokenEnd < end && *tokenEnd != ',' && *tokenEnd != ';' &&
+         *tokenEnd != '\t' && *tokenEnd != ' ' && *tokenEnd != '\n' &&
+         *tokenEnd != '\r')
+    ++tokenEnd;
+  std::string token(start, tokenEnd);
+  char* parsedEnd = nullptr;
+  out = std::strtod(token.c_str(), &parsedEnd);
+  if (parsedEnd == token.c_str()) return false;
+  p = start + (parsedEnd - token.c_str());
+  return true;
+}
+
+inline bool parseLabel(const char* begin, const char* end, std::string& out) {
+  out.assign(begin, end);
+  return true;
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type parseLabel(
+    const char* begin, const char* end, T& out) {
+  bool negative = begin < end && *begin == '-';
+  if (negative && !std::is_signed<T>::value) return false;
+  if (negative || (begin < end && *begin == '+')) ++begin;
+  if (begin == end) return false;
+  // negative values accumulate downward so the minimum is reachable; a
+  // digit that would pass the type's limit rejects the row
+  const T lowest = std::numeric_limits<T>::min();
+  const T highest = std::numeric_limits<T>::max();
+  T value = 0;
+  for (; begin < end; ++begin) {
+    if (*begin < '0' || *begin > '9') return false;
+    T digit = static_cast<T>(*begin - '0');
+    if (negative) {
+      if (value < (lowest + digit) / 10) return false;
+      value = static_cast<T>(value * 10 - digit);
+    } else {
+      if (value > (highest - digit) / 10) return false;
+      value = static_cast<T>(value * 10 + digit);
+    }
+  }
+  out = value;
+  return true;
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+parseLabel(const char* begin, const char* end, T& out) {
+  double value;
+  if (!parseDouble(begin, end, value) || begin != end) return false;
+  out = static_cast<T>(value);
+  return true;
+}
+
+// Any other label type is read with operator>>.
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value, bool>::type parseLabel(
+    const char* begin, const char* end, T& out) {
+  std::istringstream in(std::string(begin, end));
+  return static_cast<bool>(in >> out);
+}
+
+/** CSV loading */
+
+// A row is any line holding something besides a carriage return.
+inline bool isRow(const char* begin, const char* end) {
+  return end > begin && !(end - begin == 1 && *begin == '\r');
+}
+
+inline const char* lineEnd(const char* p, const char* end) {
+  const void* nl = std::memchr(p, '\n', end - p);
+  return nl ? static_cast<const char*>(nl) : end;
+}
+
+inline const char* nextLine(const char* p, const char* end) {
+  if (p >= end) return end;
+  const char* eol = lineEnd(p, end);
+  return eol < end ? eol + 1 : end;
+}
+
+template <size_t N, typename ElemType>
+bool parseCsvRow(const char* p, const char* end, char delimiter,
+                 Point<N>& point, ElemType& value) {
+  for (size_t i = 0; i < N; ++i) {
+    if (!parseDouble(p, end, point[i])) return false;
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    if (p == end || *p != delimiter) return false;
+    ++p;
+  }
+  while (end > p && (end[-1] == '\r' || end[-1] == ' ')) --end;
+  while (p < end && *p == ' ') ++p;
+  return parseLabel(p, end, value);
+}
+
+inline size_t loaderThreads(const LoaderOptions& options, size_t work) {
+  size_t threads = options.threads;
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  return std::max<size_t>(1, std::min(threads, work));
+}
+
+template <typename Fn>
+void runParallel(size_t threads, Fn fn) {
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; ++t) pool.push_back(std::thread(fn, t));
+  fn(0);
+  for (size_t t = 0; t < pool.size(); ++t) pool[t].join();
+}
+
+// Appends the rows of a CSV file to `staging`.
+template <size_t N, typename ElemType>
+LoadStats load_csv(const std::string& path,
+                   KDTreeStaging<N, ElemType>& staging,
+                   const LoaderOptions& options = LoaderOptions()) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  MappedFile file(path);
+  const char* data = file.data();
+  const char* end = data + file.size();
+  if (options.skip_header) data = nextLine(data, end);
+
+  // chunk boundaries fall just after a newline
+  size_t threads = loaderThreads(options, (end - data) / (1 << 20) + 1);
+  std::vector<const char*> bounds(threads + 1, end);
+  bounds[0] = data;
+  for (size_t t = 1; t < threads; ++t) {
+    const char* guess = data + (end - data) * t / threads;
+    bounds[t] = std::max(bounds[t - 1], nextLine(guess, end));
+  }
+
+  // pass 1: count rows so every chunk knows where it writes
+  std::vector<size_t> rows(threads + 1, 0);
+  runParallel(threads, [&](size_t t) {
+    size_t count = 0;
+    for (const char* p = bounds[t]; p < bounds[t + 1]; ) {
+      const char* next = nextLine(p, bounds[t + 1]);
+      count += isRow(p, lineEnd(p, next));
+      p = next;
+    }
+    rows[t + 1] = count;
+  });
+  size_t base = staging.size();
+  for (size_t t = 0; t < threads; ++t) rows[t + 1] += rows[t];
+  staging.resize(base + rows[threads]);
+
+  // pass 2: parse in place
+  std::vector<const char*> errors(threads, nullptr);
+  runParallel(threads, [&](size_t t) {
+    size_t row = base + rows[t];
+    for (const char* p = bounds[t]; p < bounds[t + 1]; ) {
+      const char* next = nextLine(p, bounds[t + 1]);
+      const char* eol = lineEnd(p, next);
+      if (isRow(p, eol)) {
+        if (!parseCsvRow<N>(p, eol, options.delimiter, staging.points[row],
+                            staging.values[row])) {
+          errors[t] = p;
+          return;
+        }
+        ++row;
+      }
+      p = next;
+    }
+  });
+  for (size_t t = 0; t < threads; ++t) {
+    if (errors[t]) {
+      staging.resize(base);
+      std::ostringstream message;
+      message << "load_csv: malformed row at byte " << errors[t] - file.data()
+              << " of " << path;
+      throw std::runtime_error(message.str());
+    }
+  }
+
+  LoadStats stats;
+  stats.bytes = file.size();
+  stats.rows = rows[threads];
+  stats.seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start).count();
+  return stats;
+}
+
+/** Binary loading */
+
+template <size_t N, typename ElemType>
+LoadStats load_binary(const std::string& path,
+                      KDTreeStaging<N, ElemType>& staging,
+                      const LoaderOptions& options = LoaderOptions()) {
+  static_assert(std::is_trivially_copyable<ElemType>::value,
+                "binary records need a trivially copyable payload");
+  const size_t record = N * sizeof(double) + sizeof(ElemType);
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  MappedFile file(path);
+  if (file.size() % record != 0)
+    throw std::runtime_error("load_binary: truncated record in " + path);
+  size_t count = file.size() / record;
+  size_t base = staging.size();
+  staging.resize(base + count);
+
+  size_t threads = loaderThreads(options, count / (1 << 16) + 1);
+  runParallel(threads, [&](size_t t) {
+    const char* p = file.data() + record * (count * t / threads);
+    for (size_t i = count * t / threads; i < count * (t + 1) / threads; ++i) {
+      std::memcpy(staging.points[base + i].begin(), p, N * sizeof(double));
+      std::memcpy(&staging.values[base + i], p + N * sizeof(double),
+                  sizeof(ElemType));
+      p += record;
+    }
+  });
+
+  LoadStats stats;
+  stats.bytes = file.size();
+  stats.rows = count;
+  stats.seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start).count();
+  return stats;
+}
+
+template <size_t N, typename ElemType>
+LoadStats loadStaging(const std::string& path, bool csv,
+                      KDTreeStaging<N, ElemType>& staging,
+                      const LoaderOptions& options, std::true_type) {
+  return csv ? load_csv(path, staging, options)
+             : load_binary(path, staging, options);
+}
+
+template <size_t N, typename ElemType>
+LoadStats loadStaging(const std::string& path, bool csv,
+                      KDTreeStaging<N, ElemType>& staging,
+                      const LoaderOptions& options, std::false_type) {
+  if (!csv)
+    throw std::invalid_argument(
+        "binary records need a trivially copyable payload");
+  return load_csv(path, staging, options);
+}
+
+// Loads a file (".csv" or binary) and bulk-builds `tree` from it.
+template <size_t N, typename ElemType>
+LoadStats load_file(const std::string& path, KDTree<N, ElemType>& tree,
+                    const LoaderOptions& options = LoaderOptions()) {
+  KDTreeStaging<N, ElemType> staging;
+  bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+  std::integral_constant<bool, std::is_trivially_copyable<ElemType>::value>
+      binaryOk;
+  LoadStats stats = loadStaging(path, csv, staging, options, binaryOk);
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  tree.bulk_load(staging);
+  stats.seconds += std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start).count();
+  return stats;
+}
+
+#endif  // SRC_POINTLOADER_HPP_
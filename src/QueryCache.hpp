@@ -0,0 +1,216 @@
+// Copyright
+
+#ifndef SRC_QUERYCACHE_HPP_
+#define SRC_QUERYCACHE_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Point.hpp"
+#include "PointHashIndex.hpp"
+
+// Counters of a KNNQueryCache. Latencies are the summed wall time of the
+// cached k-NN calls, split by outcome.
+struct QueryCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  uint64_t hit_nanoseconds;
+  uint64_t miss_nanoseconds;
+
+  double hit_rate() const {
+    uint64_t total = hits + misses;
+    return total ? static_cast<double>(hits) / total : 0.0;
+  }
+  double mean_hit_nanoseconds() const {
+    return hits ? static_cast<double>(hit_nanoseconds) / hits : 0.0;
+  }
+  double mean_miss_nanoseconds() const {
+    return misses ? static_cast<double>(miss_nanoseconds) / misses : 0.0;
+  }
+};
+
+// Bounded cache of k-NN results keyed by (query cell, k), with CLOCK
+// eviction over a fixed number of entries. With quantum 0 the cell is the
+// query point itself; otherwise queries falling in the same quantum-sized
+// grid cell share the result of the first one. Entries carry the owner's
+// generation counter and the whole cache is dropped when it moves on, so
+// a result never outlives the tree it was computed on. Safe to use from
+// concurrent readers.
+template <size_t N>
+class KNNQueryCache {
+ public:
+  typedef std::vector<std::pair<double, uint32_t> > Result;
+
+  // generation is the owner's current one.
+  KNNQueryCache(size_t capacity, double quantum, uint64_t generation);
+
+  // Copies the cached result for (pt, k) into out if it was computed at
+  // `generation`.
+  bool lookup(const Point<N>& pt, size_t k, uint64_t generation,
+              Result& out);
+  void store(const Point<N>& pt, size_t k, uint64_t generation,
+             const Result& result);
+  void record(bool hit, uint64_t nanoseconds);
+
+  size_t capacity() const;
+  double quantum() const;
+  QueryCacheStats stats() const;
+
+ private:
+  struct Key {
+    Point<N> cell;
+    size_t k;
+    bool operator==(const Key& other) const {
+      return k == other.k && cell == other.cell;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      typedef PointHashIndex<N, void> Hasher;
+      return static_cast<size_t>(Hasher::hashPoint(key.cell) ^
+                                 (key.k * 0x9e3779b97f4a7c15ULL));
+    }
+  };
+  struct Entry {
+    Key key;
+    Result result;
+    bool referenced;
+    bool used;
+  };
+
+  Key makeKey(const Point<N>& pt, size_t k) const;
+  void invalidate(uint64_t generation);
+  size_t victim();
+
+  mutable std::mutex mutex_;
+  std::vector<Entry> entries_;
+  std::unordered_map<Key, size_t, KeyHash> slots_;
+  size_t hand_;
+  double quantum_;
+  uint64_t generation_;
+  QueryCacheStats stats_;
+};
+
+template <size_t N>
+KNNQueryCache<N>::KNNQueryCache(size_t capacity, double quantum,
+                                uint64_t generation)
+    : entries_(capacity == 0 ? 1 : capacity),
+      hand_(0),
+      quantum_(quantum > 0 ? quantum : 0.0),
+      generation_(generation),
+      stats_() {
+  slots_.reserve(entries_.size());
+  for (size_t i = 0; i < entries_.size(); ++i)
+    entries_[i].referenced = entries_[i].used = false;
+}
+
+template <size_t N>
+typename KNNQueryCache<N>::Key KNNQueryCache<N>::makeKey(const Point<N>& pt,
+                                                         size_t k) const {
+  Key key;
+  key.k = k;
+  for (size_t i = 0; i < N; ++i)
+    key.cell[i] = quantum_ > 0 ? std::floor(pt[i] / quantum_) : pt[i];
+  return key;
+}
+
+template <size_t N>
+void KNNQueryCache<N>::invalidate(uint64_t generation) {
+  slots_.clear();
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    entries_[i].used = entries_[i].referenced = false;
+    Result().swap(entries_[i].result);
+  }
+  generation_ = generation;
+  ++stats_.invalidations;
+}
+
+// CLOCK: sweep the hand, clearing reference bits, until an entry that was
+// not used since the last sweep comes up.
+template <size_t N>
+size_t KNNQueryCache<N>::victim() {
+  for (;;) {
+    Entry& entry = entries_[hand_];
+    size_t slot = hand_;
+    hand_ = hand_ + 1 == entries_.size() ? 0 : hand_ + 1;
+    if (!entry.used) return slot;
+    if (!entry.referenced) {
+      slots_.erase(entry.key);
+      entry.used = false;
+      ++stats_.evictions;
+      return slot;
+    }
+    entry.referenced = false;
+  }
+}
+
+template <size_t N>
+bool KNNQueryCache<N>::lookup(const Point<N>& pt, size_t k,
+                              uint64_t generation, Result& out) {
+  Key key = makeKey(pt, k);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generation != generation_) {
+    invalidate(generation);
+    return false;
+  }
+  typename std::unordered_map<Key, size_t, KeyHash>::const_iterator it =
+      slots_.find(key);
+  if (it == slots_.end()) return false;
+  Entry& entry = entries_[it->second];
+  entry.referenced = true;
+  out = entry.result;
+  return true;
+}
+
+template <size_t N>
+void KNNQueryCache<N>::store(const Point<N>& pt, size_t k,
+                             uint64_t generation, const Result& result) {
+  Key key = makeKey(pt, k);
+  if (!(key == key)) return;  // NaN coordinates never match a lookup
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generation != generation_) invalidate(generation);
+  // a concurrent miss on the same key may have stored it already
+  if (slots_.count(key)) return;
+  size_t slot = victim();
+  Entry& entry = entries_[slot];
+  entry.key = key;
+  entry.result = result;
+  entry.referenced = false;
+  entry.used = true;
+  slots_[key] = slot;
+}
+
+template <size_t N>
+void KNNQueryCache<N>::record(bool hit, uint64_t nanoseconds) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (hit) {
+    ++stats_.hits;
+    stats_.hit_nanoseconds += nanoseconds;
+  } else {
+    ++stats_.misses;
+    stats_.miss_nanoseconds += nanoseconds;
+  }
+}
+
+template <size_t N>
+size_t KNNQueryCache<N>::capacity() const {
+  return entries_.size();
+}
+
+template <size_t N>
+double KNNQueryCache<N>::quantum() const {
+  return quantum_;
+}
+
+template <size_t N>
+QueryCacheStats KNNQueryCache<N>::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+#endif  // SRC_QUERYCACHE_HPP_
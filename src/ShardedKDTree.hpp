@@ -0,0 +1,517 @@
+// Copyright
+
+#ifndef SRC_SHARDEDKDTREE_HPP_
+#define SRC_SHARDEDKDTREE_HPP_
+
+#include <sched.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "KDTree.hpp"
+
+// Sharded index: space is partitioned into independent KDTree shards, each
+// owned by a worker thread pinned to one NUMA node, so a shard's nodes are
+// first-touched (allocated) and later searched on that node. Queries visit
+// only shards whose bounding box can hold a result and merge the per-shard
+// answers with a k-way heap.
+
+// CPUs of each NUMA node, from sysfs; one empty entry (no pinning) when the
+// topology is not available.
+inline std::vector<std::vector<int> > numaNodeCpus() {
+  std::vector<std::vector<int> > nodes;
+  for (int node = 0;; ++node) {
+    std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) +
+                     "/cpulist");
+    std::string list;
+    if (!in || !std::getline(in, list)) break;
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+      if (range.empty()) continue;
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    nodes.push_back(cpus);
+  }
+  if (nodes.empty()) nodes.push_back(std::vector<int>());
+  return nodes;
+}
+
+// A thread pinned to a set of CPUs running submitted jobs in order.
+class ShardWorker {
+ public:
+  explicit ShardWorker(const std::vector<int>& cpus)
+      : stop_(false), thread_(&ShardWorker::run, this, cpus) {}
+  ~ShardWorker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_one();
+    thread_.join();
+  }
+  ShardWorker(const ShardWorker&) = delete;
+  ShardWorker& operator=(const ShardWorker&) = delete;
+
+  std::future<void> submit(std::function<void()> job) {
+    std::shared_ptr<std::packaged_task<void()> > task =
+        std::make_shared<std::packaged_task<void()> >(job);
+    std::future<void> done = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back([task]() { (*task)(); });
+    }
+    ready_.notify_one();
+    return done;
+  }
+
+ private:
+  void run(std::vector<int> cpus) {
+    if (!cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (size_t i = 0; i < cpus.size(); ++i) CPU_SET(cpus[i], &set);
+      sched_setaffinity(0, sizeof(set), &set);  // best effort
+    }
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty()) return;
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      job();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()> > jobs_;
+  bool stop_;
+  std::thread thread_;
+};
+
+enum class ShardPartition {
+  kTopSplits,    // recursive median splits on the widest axis
+  kMortonRanges  // equal-count ranges of the Z-order curve
+};
+
+template <size_t N, typename ElemType>
+class ShardedKDTree {
+ public:
+  explicit ShardedKDTree(size_t shards,
+                         ShardPartition partition = ShardPartition::kTopSplits);
+
+  size_t dimension() const { return N; }
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+  size_t shard_count() const { return shards_.size(); }
+  const KDTree<N, ElemType>& shard(size_t index) const {
+    return shards_[index]->tree;
+  }
+
+  // Replaces the contents with the staged points, building every shard on
+  // its own worker. Leaves the staging buffer empty.
+  void build(KDTreeStaging<N, ElemType>& staging);
+
+  // Runs on the owning shard's worker, so new nodes are first-touched on
+  // its NUMA node too; the caller waits for it.
+  void insert(const Point<N>& pt, const ElemType& value);
+  bool contains(const Point<N>& pt) const;
+  const ElemType& at(const Point<N>& pt) const;
+
+  vector<ElemType> knn_query(const Point<N>& key, size_t k) const;
+  vector<ElemType> radius_query(const Point<N>& key, double radius) const;
+
+  // Number of shards the last query on this thread was sent to.
+  static size_t& last_fanout() {
+    static thread_local size_t fanout = 0;
+    return fanout;
+  }
+
+ private:
+  struct Shard {
+    KDTree<N, ElemType> tree;
+    double lo[N], hi[N];  // tight bounds of the shard's points
+    // insertion order across all shards, by shard-local element id
+    std::vector<uint32_t> globalIds;
+    std::unique_ptr<ShardWorker> worker;
+  };
+  struct Split {  // routing tree for kTopSplits; leaves name a shard
+    size_t axis;
+    double value;
+    size_t children[2];
+    size_t shard;
+  };
+  // (squared distance, global id, shard, element id)
+  typedef std::tuple<double, uint32_t, size_t, uint32_t> Hit;
+
+  size_t route(const Point<N>& pt) const;
+  size_t buildSplits(std::vector<std::pair<Point<N>, uint32_t> >& items,
+                     size_t begin, size_t end, size_t firstShard,
+                     size_t shardCount,
+                     std::vector<std::vector<uint32_t> >& members);
+  uint64_t morton(const Point<N>& pt) const;
+  double boxDistance(const Shard& shard, const Point<N>& pt) const;
+  void grow(Shard& shard, const Point<N>& pt);
+  template <typename Search>
+  vector<ElemType> fanOut(const Point<N>& key, double bound, size_t limit,
+                          Search search) const;
+
+  ShardPartition partition_;
+  std::vector<std::unique_ptr<Shard> > shards_;
+  std::vector<Split> splits_;
+  std::vector<uint64_t> rangeStarts_;  // first Morton code of each shard
+  double mortonLo_[N], mortonHi_[N];
+  uint32_t nextGlobal_;  // global id of the next new point
+};
+
+template <size_t N, typename ElemType>
+ShardedKDTree<N, ElemType>::ShardedKDTree(size_t shards,
+                                          ShardPartition partition)
+    : partition_(partition), nextGlobal_(0) {
+  if (shards == 0) shards = 1;
+  std::vector<std::vector<int> > nodes = numaNodeCpus();
+  for (size_t i = 0; i < shards; ++i) {
+    shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+    for (size_t d = 0; d < N; ++d) {
+      shards_[i]->lo[d] = std::numeric_limits<double>::infinity();
+      shards_[i]->hi[d] = -std::numeric_limits<double>::infinity();
+    }
+    shards_[i]->worker.reset(new ShardWorker(nodes[i % nodes.size()]));
+  }
+  Split only = {0, 0.0, {0, 0}, 0};
+  splits_.assign(1, only);
+  rangeStarts_.assign(1, 0);
+  for (size_t d = 0; d < N; ++d) mortonLo_[d] = mortonHi_[d] = 0.0;
+}
+
+template <size_t N, typename ElemType>
+size_t ShardedKDTree<N, ElemType>::size() const {
+  size_t total = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) total += shards_[i]->tree.size();
+  return total;
+}
+
+// Interleaves min(64 / N, 21) bits per axis, quantized over the build's
+// bounds; later points outside them are clamped to the edge cells.
+template <size_t N, typename ElemType>
+uint64_t ShardedKDTree<N, ElemType>::morton(const Point<N>& pt) const {
+  const size_t bits = 64 / N < 21 ? 64 / N : 21;
+  const double cells = static_cast<double>((uint64_t(1) << bits) - 1);
+  uint64_t q[N];
+  for (size_t d = 0; d < N; ++d) {
+    double extent = mortonHi_[d] - mortonLo_[d];
+    double t = extent > 0 ? (pt[d] - mortonLo_[d]) / extent : 0.0;
+    t = std::min(1.0, std::max(0.0, t));
+    q[d] = static_cast<uint64_t>(t * cells);
+  }
+  uint64_t code = 0;
+  for (size_t b = bits; b-- > 0;)
+    for (size_t d = 0; d < N; ++d) code = (code << 1) | ((q[d] >> b) & 1);
+  return code;
+}
+
+template <size_t N, typename ElemType>
+size_t ShardedKDTree<N, ElemType>::route(const Point<N>& pt) const {
+  if (partition_ == ShardPartition::kMortonRanges) {
+    return std::upper_bound(rangeStarts_.begin(), rangeStarts_.end(),
+                            morton(pt)) -
+           rangeStarts_.begin() - 1;
+  }
+  size_t index = 0;
+  while (splits_[index].children[0] != 0) {
+    const Split& split = splits_[index];
+    index = split.children[pt[split.axis] >= split.value];
+  }
+  return splits_[index].shard;
+}
+
+// Splits items[begin, end) among shardCount shards in proportion, by
+// value on the widest axis so equal points always share a shard.
+template <size_t N, typename ElemType>
+size_t ShardedKDTree<N, ElemType>::buildSplits(
+    std::vector<std::pair<Point<N>, uint32_t> >& items, size_t begin,
+    size_t end, size_t firstShard, size_t shardCount,
+    std::vector<std::vector<uint32_t> >& members) {
+  size_t index = splits_.size();
+  Split split = {0, 0.0, {0, 0}, firstShard};
+  splits_.push_back(split);
+  if (shardCount == 1 || end - begin < 2) {
+    for (size_t i = begin; i < end; ++i)
+      members[firstShard].push_back(items[i].second);
+    return index;
+  }
+  double lo[N], hi[N];
+  for (size_t d = 0; d < N; ++d) lo[d] = hi[d] = items[begin].first[d];
+  for (size_t i = begin; i < end; ++i)
+    for (size_t d = 0; d < N; ++d) {
+      lo[d] = std::min(lo[d], items[i].first[d]);
+      hi[d] = std::max(hi[d], items[i].first[d]);
+    }
+  size_t axis = 0;
+  for (size_t d = 1; d < N; ++d)
+    if (hi[d] - lo[d] > hi[axis] - lo[axis]) axis = d;
+  size_t leftShards = shardCount / 2;
+  size_t cut = begin + (end - begin) * leftShards / shardCount;
+  std::nth_element(items.begin() + begin, items.begin() + cut,
+                   items.begin() + end,
+                   [axis](const std::pair<Point<N>, uint32_t>& a,
+                          const std::pair<Point<N>, uint32_t>& b) {
+                     return a.first[axis] < b.first[axis];
+                   });
+  double value = items[cut].first[axis];
+  // the median itself starts the right side
+  size_t mid =
+      std::partition(items.begin() + begin, items.begin() + end,
+                     [axis, value](const std::pair<Point<N>, uint32_t>& e) {
+                       return e.first[axis] < value;
+                     }) -
+      items.begin();
+  size_t left = buildSplits(items, begin, mid, firstShard, leftShards, members);
+  size_t right = buildSplits(items, mid, end, firstShard + leftShards,
+                             shardCount - leftShards, members);
+  splits_[index].axis = axis;
+  splits_[index].value = value;
+  splits_[index].children[0] = left;
+  splits_[index].children[1] = right;
+  return index;
+}
+
+template <size_t N, typename ElemType>
+void ShardedKDTree<N, ElemType>::grow(Shard& shard, const Point<N>& pt) {
+  for (size_t d = 0; d < N; ++d) {
+    shard.lo[d] = std::min(shard.lo[d], pt[d]);
+    shard.hi[d] = std::max(shard.hi[d], pt[d]);
+  }
+}
+
+template <size_t N, typename ElemType>
+void ShardedKDTree<N, ElemType>::build(KDTreeStaging<N, ElemType>& staging) {
+  size_t count = staging.size();
+  size_t shardCount = shards_.size();
+  std::vector<std::vector<uint32_t> > members(shardCount);
+  splits_.clear();
+  if (partition_ == ShardPartition::kTopSplits) {
+    std::vector<std::pair<Point<N>, uint32_t> > items(count);
+    for (size_t i = 0; i < count; ++i)
+      items[i] = std::make_pair(staging.points[i], static_cast<uint32_t>(i));
+    buildSplits(items, 0, count, 0, shardCount, members);
+  } else {
+    Split only = {0, 0.0, {0, 0}, 0};
+    splits_.push_back(only);
+    for (size_t d = 0; d < N; ++d) {
+      mortonLo_[d] = count ? staging.points[0][d] : 0.0;
+      mortonHi_[d] = mortonLo_[d];
+    }
+    for (size_t i = 0; i < count; ++i)
+      for (size_t d = 0; d < N; ++d) {
+        mortonLo_[d] = std::min(mortonLo_[d], staging.points[i][d]);
+        mortonHi_[d] = std::max(mortonHi_[d], staging.points[i][d]);
+      }
+    std::vector<std::pair<uint64_t, uint32_t> > codes(count);
+    for (size_t i = 0; i < count; ++i)
+      codes[i] = std::make_pair(morton(staging.points[i]),
+                                static_cast<uint32_t>(i));
+    std::sort(codes.begin(), codes.end());
+    // equal-count cuts, moved forward so a code never spans two shards
+    rangeStarts_.assign(1, 0);
+    size_t begin = 0;
+    for (size_t s = 0; s < shardCount; ++s) {
+      size_t end = s + 1 == shardCount ? count : count * (s + 1) / shardCount;
+      end = std::max(end, begin);
+      while (end > 0 && end < count && codes[end].first == codes[end - 1].first)
+        ++end;
+      for (size_t i = begin; i < end; ++i)
+        members[s].push_back(codes[i].second);
+      if (s + 1 < shardCount)
+        rangeStarts_.push_back(end < count
+                                   ? codes[end].first
+                                   : std::numeric_limits<uint64_t>::max());
+      begin = end;
+    }
+  }
+
+  // Shards stage their members in staging order, so a repeated point keeps
+  // its last value and takes its global id from the first occurrence, as
+  // in a single bulk_load. Staging indices order like those ids.
+  for (size_t s = 0; s < shardCount; ++s)
+    std::sort(members[s].begin(), members[s].end());
+  nextGlobal_ = static_cast<uint32_t>(count);
+
+  // each shard is staged and built by its pinned worker (first touch)
+  std::vector<std::future<void> > done;
+  for (size_t s = 0; s < shardCount; ++s) {
+    Shard* shard = shards_[s].get();
+    const std::vector<uint32_t>* ids = &members[s];
+    done.push_back(shard->worker->submit([this, shard, ids, &staging]() {
+      KDTreeStaging<N, ElemType> local;
+      local.points.reserve(ids->size());
+      local.values.reserve(ids->size());
+      for (size_t d = 0; d < N; ++d) {
+        shard->lo[d] = std::numeric_limits<double>::infinity();
+        shard->hi[d] = -std::numeric_limits<double>::infinity();
+      }
+      for (size_t i = 0; i < ids->size(); ++i) {
+        local.points.push_back(staging.points[(*ids)[i]]);
+        local.values.push_back(staging.values[(*ids)[i]]);
+        grow(*shard, staging.points[(*ids)[i]]);
+      }
+      shard->tree = KDTree<N, ElemType>();
+      shard->tree.bulk_load(local);
+      shard->globalIds.assign(shard->tree.size(), 0);
+      std::vector<bool> seen(shard->tree.size(), false);
+      for (size_t i = 0; i < ids->size(); ++i) {
+        typename KDTree<N, ElemType>::node_type** node;
+        shard->tree.find(staging.points[(*ids)[i]], node);
+        uint32_t local = (*node)->payloadIndex;
+        if (seen[local]) continue;
+        seen[local] = true;
+        shard->globalIds[local] = (*ids)[i];
+      }
+    }));
+  }
+  for (size_t s = 0; s < done.size(); ++s) done[s].get();
+  staging.clear();
+}
+
+template <size_t N, typename ElemType>
+void ShardedKDTree<N, ElemType>::insert(const Point<N>& pt,
+                                        const ElemType& value) {
+  Shard* shard = shards_[route(pt)].get();
+  shard->worker
+      ->submit([this, shard, &pt, &value]() {
+        size_t before = shard->tree.size();
+        shard->tree.insert(pt, value);
+        if (shard->tree.size() != before)
+          shard->globalIds.push_back(nextGlobal_++);
+        grow(*shard, pt);
+      })
+      .get();
+}
+
+template <size_t N, typename ElemType>
+bool ShardedKDTree<N, ElemType>::contains(const Point<N>& pt) const {
+  return shards_[route(pt)]->tree.contains(pt);
+}
+
+template <size_t N, typename ElemType>
+const ElemType& ShardedKDTree<N, ElemType>::at(const Point<N>& pt) const {
+  return shards_[route(pt)]->tree.at(pt);
+}
+
+template <size_t N, typename ElemType>
+double ShardedKDTree<N, ElemType>::boxDistance(const Shard& shard,
+                                               const Point<N>& pt) const {
+  if (shard.tree.empty()) return std::numeric_limits<double>::infinity();
+  double result = 0.0;
+  for (size_t d = 0; d < N; ++d) {
+    double gap = std::max(shard.lo[d] - pt[d], pt[d] - shard.hi[d]);
+    if (gap > 0) result += gap * gap;
+  }
+  return result;
+}
+
+// Runs `search(tree)` (ascending (squared distance, id) lists) on every
+// shard whose box is within `bound`, nearest shard first and inline so its
+// answer can tighten the bound, the rest in parallel on their workers; then
+// merges the lists with a k-way heap on (distance, global id), so ties
+// come out in insertion order as from a single tree, keeping at most
+// `limit` results.
+template <size_t N, typename ElemType>
+template <typename Search>
+vector<ElemType> ShardedKDTree<N, ElemType>::fanOut(const Point<N>& key,
+                                                    double bound, size_t limit,
+                                                    Search search) const {
+  std::vector<std::pair<double, size_t> > order;
+  for (size_t s = 0; s < shards_.size(); ++s) {
+    double dist = boxDistance(*shards_[s], key);
+    if (dist <= bound) order.push_back(std::make_pair(dist, s));
+  }
+  std::sort(order.begin(), order.end());
+  std::vector<vector<pair<double, uint32_t> > > lists(shards_.size());
+  last_fanout() = order.size();
+  if (order.empty()) return vector<ElemType>();
+
+  size_t first = order[0].second;
+  lists[first] = search(shards_[first]->tree);
+  if (limit > 0 && lists[first].size() >= limit)
+    bound = std::min(bound, lists[first][limit - 1].first);
+  std::vector<std::future<void> > pending;
+  size_t sent = 1;
+  for (size_t i = 1; i < order.size(); ++i) {
+    if (order[i].first > bound) break;
+    size_t s = order[i].second;
+    const KDTree<N, ElemType>* tree = &shards_[s]->tree;
+    vector<pair<double, uint32_t> >* out = &lists[s];
+    pending.push_back(shards_[s]->worker->submit(
+        [tree, out, &search]() { *out = search(*tree); }));
+    ++sent;
+  }
+  for (size_t i = 0; i < pending.size(); ++i) pending[i].get();
+  last_fanout() = sent;
+
+  // Each shard's list is ordered by (distance, local id) and local ids
+  // follow global ids within a shard, so the lists are already ordered
+  // for the merge.
+  std::priority_queue<Hit, std::vector<Hit>, std::greater<Hit> > heads;
+  std::vector<size_t> next(shards_.size(), 0);
+  auto advance = [&](size_t s) {
+    if (next[s] == lists[s].size()) return;
+    const pair<double, uint32_t>& hit = lists[s][next[s]++];
+    heads.push(Hit(hit.first, shards_[s]->globalIds[hit.second], s,
+                   hit.second));
+  };
+  for (size_t s = 0; s < lists.size(); ++s) advance(s);
+  vector<ElemType> result;
+  while (!heads.empty() && (limit == 0 || result.size() < limit)) {
+    Hit top = heads.top();
+    heads.pop();
+    size_t s = std::get<2>(top);
+    result.push_back(shards_[s]->tree.payload_by_id(std::get<3>(top)));
+    advance(s);
+  }
+  return result;
+}
+
+template <size_t N, typename ElemType>
+vector<ElemType> ShardedKDTree<N, ElemType>::knn_query(const Point<N>& key,
+                                                       size_t k) const {
+  if (k == 0) return vector<ElemType>();
+  return fanOut(key, std::numeric_limits<double>::infinity(), k,
+                [&key, k](const KDTree<N, ElemType>& tree) {
+                  return tree.knn_search(key, k);
+                });
+}
+
+template <size_t N, typename ElemType>
+vector<ElemType> ShardedKDTree<N, ElemType>::radius_query(const Point<N>& key,
+                                                          double radius) const {
+  return fanOut(key, radius * radius, 0,
+                [&key, radius](const KDTree<N, ElemType>& tree) {
+                  return tree.radius_search(key, radius);
+                });
+}
+
+#endif  // SRC_SHARDEDKDTREE_HPP_
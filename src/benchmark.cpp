@@ -0,0 +1,237 @@
+// Copyright
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "KDTree.hpp"
+
+// Microbenchmark of the compile-time specialized kernels against the
+// generic loops they replaced: distance, point comparison, and a full
+// exact-match descent (modulo axis + loop compare vs. specialized path).
+// Then compares find/contains loops with find_batch/contains_batch on a
+// tree several times larger than the last-level cache, where the batched
+// path overlaps the misses of independent descents.
+// Also compares adding a batch to a populated tree one insert at a time
+// with insert_batch.
+
+typedef std::chrono::steady_clock bench_clock;
+
+template <size_t N>
+std::vector<Point<N> > random_points(size_t count, std::mt19937_64& rng) {
+  std::uniform_real_distribution<double> coord(0.0, 1.0);
+  std::vector<Point<N> > points(count);
+  for (size_t i = 0; i < count; ++i)
+    for (size_t j = 0; j < N; ++j) points[i][j] = coord(rng);
+  return points;
+}
+
+template <typename Fn>
+double time_ns_per_op(size_t ops, Fn fn) {
+  bench_clock::time_point start = bench_clock::now();
+  fn();
+  bench_clock::duration elapsed = bench_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+}
+
+// The descent find() used before specialization: modulo per level and a
+// loop comparison against the runtime dimension_ member. Kept here only as
+// the baseline.
+template <size_t N, typename Node>
+bool generic_contains(const Node* node, const Point<N>& pt,
+                      size_t dimension) {
+  size_t iterator = 0;
+  while (node &&
+         !GenericPointKernel<N>::equal(node->nodePoint.begin(), pt.begin())) {
+    node = node->nextNodes[pt[iterator % dimension] >
+                           node->nodePoint[iterator % dimension]];
+    iterator++;
+  }
+  return node != nullptr;
+}
+
+template <size_t N, typename Node>
+bool specialized_contains(const Node* node, const Point<N>& pt) {
+  size_t axis = 0;
+  while (node && node->nodePoint != pt) {
+    node = node->nextNodes[pt[axis] > node->nodePoint[axis]];
+    axis = KDTree<N, size_t>::nextAxis(axis);
+  }
+  return node != nullptr;
+}
+
+template <size_t N>
+void run(size_t count, size_t repeats) {
+  typedef KDTreeNode<N> Node;
+  std::mt19937_64 rng(N);
+  std::vector<Point<N> > points = random_points<N>(count, rng);
+  std::vector<Point<N> > queries = random_points<N>(count, rng);
+
+  // Same insertion rule as KDTree::insert, built here so both descents
+  // walk an identical tree.
+  std::vector<Node*> owned;
+  Node* root = nullptr;
+  for (size_t i = 0; i < count; ++i) {
+    Node** slot = &root;
+    size_t axis = 0;
+    while (*slot) {
+      slot = &(*slot)->nextNodes[points[i][axis] > (*slot)->nodePoint[axis]];
+      axis = KDTree<N, size_t>::nextAxis(axis);
+    }
+    *slot = new Node(points[i], static_cast<uint32_t>(i));
+    owned.push_back(*slot);
+  }
+
+  volatile size_t runtime_dimension = N;
+  size_t dimension = runtime_dimension;
+  volatile double sink = 0.0;
+  size_t ops = count * repeats;
+
+  // warm caches and the tree before timing
+  for (size_t i = 0; i < count; ++i)
+    sink = sink + specialized_contains<N>(root, points[i]);
+
+  double generic_dist = time_ns_per_op(ops, [&] {
+    double acc = 0.0;
+    for (size_t r = 0; r < repeats; ++r)
+      for (size_t i = 0; i < count; ++i)
+        acc += GenericPointKernel<N>::squaredDistance(points[i].begin(),
+                                                      queries[i].begin());
+    sink = acc;
+  });
+  double fast_dist = time_ns_per_op(ops, [&] {
+    double acc = 0.0;
+    for (size_t r = 0; r < repeats; ++r)
+      for (size_t i = 0; i < count; ++i)
+        acc += squared_distance(points[i], queries[i]);
+    sink = acc;
+  });
+
+  double generic_find = time_ns_per_op(ops, [&] {
+    size_t hits = 0;
+    for (size_t r = 0; r < repeats; ++r)
+      for (size_t i = 0; i < count; ++i)
+        hits += generic_contains<N>(root, points[i], dimension);
+    sink = hits;
+  });
+  double fast_find = time_ns_per_op(ops, [&] {
+    size_t hits = 0;
+    for (size_t r = 0; r < repeats; ++r)
+      for (size_t i = 0; i < count; ++i)
+        hits += specialized_contains<N>(root, points[i]);
+    sink = hits;
+  });
+
+  std::printf("N=%zu  distance: generic %7.2f ns  specialized %7.2f ns (x%.2f)\n",
+              N, generic_dist, fast_dist, generic_dist / fast_dist);
+  std::printf("N=%zu  find:     generic %7.2f ns  specialized %7.2f ns (x%.2f)\n",
+              N, generic_find, fast_find, generic_find / fast_find);
+
+  for (size_t i = 0; i < owned.size(); ++i) delete owned[i];
+  (void)sink;
+}
+
+// Looks up `lookups` points, half present and half missing, in random
+// order in a bulk-loaded tree of `count` points.
+template <size_t N>
+void run_batch_find(size_t count, size_t lookups) {
+  typedef typename KDTree<N, size_t>::node_type Node;
+  std::mt19937_64 rng(N + 200);
+  KDTreeStaging<N, size_t> staging;
+  staging.points = random_points<N>(count, rng);
+  staging.values.assign(count, 0);
+  std::vector<Point<N> > queries = random_points<N>(lookups, rng);
+  std::uniform_int_distribution<size_t> pick(0, count - 1);
+  for (size_t i = 0; i < lookups; i += 2)
+    queries[i] = staging.points[pick(rng)];
+  KDTree<N, size_t> tree;
+  tree.bulk_load(staging);
+
+  volatile size_t sink = 0;
+  double loop_contains = time_ns_per_op(lookups, [&] {
+    size_t hits = 0;
+    for (size_t i = 0; i < lookups; ++i) hits += tree.contains(queries[i]);
+    sink = hits;
+  });
+  double batch_contains = time_ns_per_op(lookups, [&] {
+    std::vector<bool> found = tree.contains_batch(queries);
+    sink = found.size();
+  });
+  std::vector<Node*> nodes(lookups);
+  double loop_find = time_ns_per_op(lookups, [&] {
+    for (size_t i = 0; i < lookups; ++i) {
+      Node** slot = nullptr;
+      nodes[i] = tree.find(queries[i], slot) ? *slot : nullptr;
+    }
+  });
+  double batch_find = time_ns_per_op(lookups, [&] {
+    tree.find_batch(queries.data(), lookups, nodes.data());
+  });
+
+  std::printf("N=%zu  contains (%zu points): loop %7.2f ns  contains_batch %7.2f ns (x%.2f)\n",
+              N, count, loop_contains, batch_contains,
+              loop_contains / batch_contains);
+  std::printf("N=%zu  find     (%zu points): loop %7.2f ns  find_batch     %7.2f ns (x%.2f)\n",
+              N, count, loop_find, batch_find, loop_find / batch_find);
+  (void)sink;
+}
+
+// Grows a tree of `count` points by `rounds` batches of `count` / 2 each.
+template <size_t N>
+void run_batch_insert(size_t count, size_t rounds) {
+  std::mt19937_64 rng(N + 100);
+  std::vector<Point<N> > points = random_points<N>(count, rng);
+  std::vector<Point<N> > queries = random_points<N>(10000, rng);
+  std::vector<std::vector<std::pair<Point<N>, size_t> > > batches(rounds);
+  for (size_t r = 0; r < rounds; ++r) {
+    std::vector<Point<N> > fresh = random_points<N>(count / 2, rng);
+    for (size_t i = 0; i < fresh.size(); ++i)
+      batches[r].push_back(std::make_pair(fresh[i], i));
+  }
+  KDTreeStaging<N, size_t> staging;
+  staging.points = points;
+  staging.values.assign(count, 0);
+  KDTree<N, size_t> single;
+  single.bulk_load(staging);
+  KDTree<N, size_t> batched = single;
+
+  size_t ops = rounds * (count / 2);
+  double loop = time_ns_per_op(ops, [&] {
+    for (size_t r = 0; r < rounds; ++r)
+      for (size_t i = 0; i < batches[r].size(); ++i)
+        single.insert(batches[r][i].first, batches[r][i].second);
+  });
+  double batch = time_ns_per_op(ops, [&] {
+    for (size_t r = 0; r < rounds; ++r)
+      batched.insert_batch(batches[r].begin(), batches[r].end());
+  });
+  volatile size_t sink = 0;
+  double loop_knn = time_ns_per_op(queries.size(), [&] {
+    for (size_t i = 0; i < queries.size(); ++i)
+      sink = sink + single.knn_search(queries[i], 8).size();
+  });
+  double batch_knn = time_ns_per_op(queries.size(), [&] {
+    for (size_t i = 0; i < queries.size(); ++i)
+      sink = sink + batched.knn_search(queries[i], 8).size();
+  });
+
+  std::printf("N=%zu  insert:   loop    %7.2f ns  insert_batch %7.2f ns (x%.2f)\n",
+              N, loop, batch, loop / batch);
+  std::printf("N=%zu  8-NN after: loop  %7.2f ns  insert_batch %7.2f ns\n",
+              N, loop_knn, batch_knn);
+}
+
+int main(int argc, char** argv) {
+  size_t count = argc > 1 ? std::stoul(argv[1]) : 100000;
+  size_t repeats = argc > 2 ? std::stoul(argv[2]) : 10;
+  size_t large = argc > 3 ? std::stoul(argv[3]) : 4000000;
+  run<1>(count, repeats);
+  run<2>(count, repeats);
+  run<3>(count, repeats);
+  run<4>(count, repeats);
+  run<8>(count, repeats);
+  run_batch_find<3>(large, 1000000);
+  run_batch_insert<3>(count, 4);
+  return 0;
+}
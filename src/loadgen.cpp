@@ -0,0 +1,247 @@
+// Copyright
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "KDTree.hpp"
+#include "LatencyHistogram.hpp"
+
+// Non-interactive load generator: many threads drive a weighted mix of
+// insert, contains, knn_query and box_search against one shared tree and
+// report per-operation latency percentiles and throughput.
+//
+// With --rate the load is open-loop: each thread has a fixed schedule of
+// intended start times and latency is measured from the intended start,
+// so time spent queued behind a slow operation is counted (no coordinated
+// omission). Without it every thread issues back to back. Threads sleep
+// until kSpinWindow before each intended start and yield-spin the rest,
+// so timer wake-up slack is not charged to the operation. Open-loop runs
+// also report service time, measured from the actual start.
+
+typedef std::chrono::steady_clock load_clock;
+typedef KDTree<3, uint32_t> Tree;
+
+static const std::chrono::microseconds kSpinWindow(50);
+
+enum Operation { kInsert, kContains, kKnn, kRange, kOperations };
+static const char* const kOperationNames[kOperations] = {
+    "insert", "contains", "knn", "range"};
+
+struct LoadOptions {
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  double seconds = 5.0;
+  double rate = 0.0;  // total operations per second, 0 for closed loop
+  size_t points = 100000;
+  size_t k = 8;
+  double range = 0.02;  // side of the range query box
+  unsigned weights[kOperations] = {5, 45, 40, 10};
+  uint64_t seed = 1;
+};
+
+struct ThreadResult {
+  LatencyHistogram latency[kOperations];  // from the intended start
+  LatencyHistogram service[kOperations];  // from the actual start
+};
+
+static void usage(const char* program) {
+  std::fprintf(stderr,
+               "usage: %s [--threads T] [--seconds S] [--rate OPS_PER_SEC]\n"
+               "          [--points P] [--k K] [--range SIDE]\n"
+               "          [--mix INSERT:CONTAINS:KNN:RANGE] [--seed S]\n",
+               program);
+}
+
+static bool parse_mix(const char* text, unsigned* weights) {
+  unsigned total = 0;
+  for (size_t op = 0; op < kOperations; ++op) {
+    char* end;
+    unsigned long weight = std::strtoul(text, &end, 10);
+    if (end == text) return false;
+    weights[op] = static_cast<unsigned>(weight);
+    total += weights[op];
+    if (op + 1 < kOperations) {
+      if (*end != ':') return false;
+      text = end + 1;
+    } else if (*end != '\0') {
+      return false;
+    }
+  }
+  return total > 0;
+}
+
+static bool parse_options(int argc, char** argv, LoadOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string flag = argv[i];
+    if (i + 1 >= argc) return false;
+    const char* value = argv[++i];
+    if (flag == "--threads") {
+      options.threads = std::strtoul(value, nullptr, 10);
+    } else if (flag == "--seconds") {
+      options.seconds = std::strtod(value, nullptr);
+    } else if (flag == "--rate") {
+      options.rate = std::strtod(value, nullptr);
+    } else if (flag == "--points") {
+      options.points = std::strtoul(value, nullptr, 10);
+    } else if (flag == "--k") {
+      options.k = std::strtoul(value, nullptr, 10);
+    } else if (flag == "--range") {
+      options.range = std::strtod(value, nullptr);
+    } else if (flag == "--mix") {
+      if (!parse_mix(value, options.weights)) return false;
+    } else if (flag == "--seed") {
+      options.seed = std::strtoull(value, nullptr, 10);
+    } else {
+      return false;
+    }
+  }
+  return options.threads > 0 && options.seconds > 0 && options.rate >= 0;
+}
+
+static Point<3> random_point(std::mt19937_64& rng) {
+  std::uniform_real_distribution<double> coord(0.0, 1.0);
+  Point<3> pt;
+  for (size_t i = 0; i < 3; ++i) pt[i] = coord(rng);
+  return pt;
+}
+
+// Readers share the tree; inserts take it exclusively.
+static void drive(Tree& tree, std::shared_timed_mutex& lock,
+                  const LoadOptions& options, size_t index,
+                  load_clock::time_point start, load_clock::time_point stop,
+                  std::atomic<uint32_t>& nextId, ThreadResult& result) {
+  std::mt19937_64 rng(options.seed * 1000003 + index + 1);
+  unsigned total = 0;
+  for (size_t op = 0; op < kOperations; ++op) total += options.weights[op];
+  std::uniform_int_distribution<unsigned> pick(0, total - 1);
+  // seconds between a thread's intended starts; kept in floating point so
+  // rates above one per nanosecond do not round the schedule to zero
+  double interval = options.rate > 0 ? options.threads / options.rate : 0.0;
+  volatile size_t sink = 0;
+
+  load_clock::time_point intended = start;
+  for (uint64_t issued = 0;; ++issued) {
+    if (options.rate > 0) {
+      intended = start + std::chrono::duration_cast<load_clock::duration>(
+                             std::chrono::duration<double>(interval * issued));
+      if (intended >= stop) break;
+      std::this_thread::sleep_until(intended - kSpinWindow);
+      while (load_clock::now() < intended) std::this_thread::yield();
+    }
+    load_clock::time_point begin = load_clock::now();
+    // a schedule the tree cannot keep up with still ends on time
+    if (begin >= stop) break;
+    if (options.rate == 0) intended = begin;
+
+    unsigned roll = pick(rng);
+    size_t op = 0;
+    while (roll >= options.weights[op]) roll -= options.weights[op++];
+    Point<3> pt = random_point(rng);
+    switch (op) {
+      case kInsert: {
+        std::unique_lock<std::shared_timed_mutex> guard(lock);
+        tree.insert(pt, nextId++);
+        break;
+      }
+      case kContains: {
+        std::shared_lock<std::shared_timed_mutex> guard(lock);
+        sink = sink + tree.contains(pt);
+        break;
+      }
+      case kKnn: {
+        std::shared_lock<std::shared_timed_mutex> guard(lock);
+        sink = sink + tree.knn_query(pt, options.k).size();
+        break;
+      }
+      case kRange: {
+        Point<3> hi = pt;
+        for (size_t i = 0; i < 3; ++i) hi[i] += options.range;
+        std::shared_lock<std::shared_timed_mutex> guard(lock);
+        sink = sink + tree.box_search(pt, hi).size();
+        break;
+      }
+    }
+    load_clock::time_point end = load_clock::now();
+    std::chrono::nanoseconds latency = end - intended;
+    std::chrono::nanoseconds service = end - begin;
+    result.latency[op].record(static_cast<uint64_t>(latency.count()));
+    result.service[op].record(static_cast<uint64_t>(service.count()));
+  }
+  (void)sink;
+}
+
+static void report(const LatencyHistogram& histogram, const char* name,
+                   double seconds) {
+  std::printf("%-9s %10llu %12.0f %10.2f %10.2f %10.2f %10.2f\n", name,
+              static_cast<unsigned long long>(histogram.count()),
+              histogram.count() / seconds,
+              histogram.value_at_percentile(50) / 1e3,
+              histogram.value_at_percentile(99) / 1e3,
+              histogram.value_at_percentile(99.9) / 1e3,
+              histogram.max() / 1e3);
+}
+
+static void report_table(const std::vector<ThreadResult>& results,
+                         bool service, double seconds) {
+  std::printf("%-9s %10s %12s %10s %10s %10s %10s\n", "op", "count",
+              "ops/s", "p50 us", "p99 us", "p99.9 us", "max us");
+  LatencyHistogram all;
+  for (size_t op = 0; op < kOperations; ++op) {
+    LatencyHistogram merged;
+    for (size_t t = 0; t < results.size(); ++t)
+      merged.merge(service ? results[t].service[op]
+                           : results[t].latency[op]);
+    if (merged.count()) report(merged, kOperationNames[op], seconds);
+    all.merge(merged);
+  }
+  report(all, "all", seconds);
+}
+
+int main(int argc, char** argv) {
+  LoadOptions options;
+  if (!parse_options(argc, argv, options)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Tree tree;
+  KDTreeStaging<3, uint32_t> staging;
+  std::mt19937_64 rng(options.seed);
+  for (size_t i = 0; i < options.points; ++i) {
+    staging.points.push_back(random_point(rng));
+    staging.values.push_back(static_cast<uint32_t>(i));
+  }
+  tree.bulk_load(staging);
+  std::shared_timed_mutex lock;
+  std::atomic<uint32_t> nextId(static_cast<uint32_t>(options.points));
+
+  std::vector<ThreadResult> results(options.threads);
+  std::vector<std::thread> pool;
+  load_clock::time_point start = load_clock::now();
+  load_clock::time_point stop =
+      start + std::chrono::duration_cast<load_clock::duration>(
+                  std::chrono::duration<double>(options.seconds));
+  for (size_t t = 0; t < options.threads; ++t)
+    pool.push_back(std::thread(drive, std::ref(tree), std::ref(lock),
+                               std::cref(options), t, start, stop,
+                               std::ref(nextId), std::ref(results[t])));
+  for (size_t t = 0; t < pool.size(); ++t) pool[t].join();
+  double elapsed =
+      std::chrono::duration<double>(load_clock::now() - start).count();
+
+  std::printf("threads %zu, %s, %.1f s, %zu initial points, %zu final\n",
+              options.threads,
+              options.rate > 0 ? "open loop" : "closed loop", elapsed,
+              options.points, tree.size());
+  report_table(results, false, elapsed);
+  if (options.rate > 0) {
+    std::printf("service time (from the actual start)\n");
+    report_table(results, true, elapsed);
+  }
+  return 0;
+}
@@ -1,26 +1,55 @@
 // Copyright
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmath>
 #include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <set>
 #include <sstream>
 #include <string>
 #include <vector>
+#include "ExternalKDTree.hpp"
+#include "CompactKDTree.hpp"
 #include "KDTree.hpp"
+#include "PointLoader.hpp"
+#include "ShardedKDTree.hpp"
 
 #define TEST_BASIC_KD_TREE_ENABLED 1
 #define TEST_MODERATE_KD_TREE_ENABLED 1
 #define TEST_HARDER_KD_TREE_ENABLED 1
-#define TEST_EDGE_CASE_KD_TREE_ENABLED 0
-#define TEST_MUTATING_KD_TREE_ENABLED 0
-#define TEST_THROWING_KD_TREE_ENABLED 0
-#define TEST_CONST_KD_TREE_ENABLED 0
-
-#define TEST_NEAREST_NEIGHBOR_ENABLED 0
-#define TEST_MORE_NEAREST_NEIGHBOR_ENABLED 0
-
-#define TEST_BASIC_COPY_ENABLED 0
-#define TEST_MODERATE_COPY_ENABLED 0
+#define TEST_EDGE_CASE_KD_TREE_ENABLED 1
+#define TEST_MUTATING_KD_TREE_ENABLED 1
+#define TEST_THROWING_KD_TREE_ENABLED 1
+#define TEST_CONST_KD_TREE_ENABLED 1
+
+#define TEST_NEAREST_NEIGHBOR_ENABLED 1
+#define TEST_MORE_NEAREST_NEIGHBOR_ENABLED 1
+
+#define TEST_BASIC_COPY_ENABLED 1
+#define TEST_MODERATE_COPY_ENABLED 1
+
+#define TEST_BATCH_LOOKUP_ENABLED 1
+#define TEST_PAYLOAD_KD_TREE_ENABLED 1
+#define TEST_ALL_KNN_ENABLED 1
+#define TEST_HASH_INDEX_ENABLED 1
+#define TEST_BULK_LOADER_ENABLED 1
+#define TEST_EXTERNAL_BUILD_ENABLED 1
+#define TEST_SHARDED_KD_TREE_ENABLED 1
+#define TEST_QUERY_CACHE_ENABLED 1
+#define TEST_BOX_SEARCH_ENABLED 1
+#define TEST_COMPACT_KD_TREE_ENABLED 1
+#define TEST_BOUNDING_BOXES_ENABLED 1
+#define TEST_ASYNC_QUERY_ENABLED 1
+#define TEST_BATCH_INSERT_ENABLED 1
 
 template <size_t N, typename IteratorType>
 Point<N> point_from_range(IteratorType begin, IteratorType end) {
@@ -334,6 +363,35 @@ void test_throwing_kd_tree() try {
     CHECK_CONDITION(did_throw, "Exception generated during const lookup.");
   }
 
+  {
+    KDTree<2, int> empty;
+
+    bool did_throw = false;
+    try {
+      empty.knn_value(make_point(0, 0), 3);
+    } catch (const std::out_of_range&) {
+      did_throw = true;
+    }
+
+    CHECK_CONDITION(did_throw, "Exception generated during empty k-NN vote.");
+  }
+
+  {
+    KDTree<2, int> kd;
+    kd.insert(make_point(0, 0), 1);
+
+    bool did_throw = false;
+    try {
+      kd.knn_value(make_point(0, 0), 0);
+    } catch (const std::out_of_range&) {
+      did_throw = true;
+    }
+
+    CHECK_CONDITION(did_throw, "Exception generated during k = 0 k-NN vote.");
+    CHECK_CONDITION(kd.knn_value(make_point(5, 5), 3) == 1,
+                    "k-NN vote clamps k to the tree size.");
+  }
+
   end_test();
 #else
   test_disabled("test_throwing_kd_tree");
@@ -610,6 +668,950 @@ void test_moderate_copy() try {
   fail_test(e);
 }
 
+void test_batch_lookup() try {
+#if TEST_BATCH_LOOKUP_ENABLED
+  print_banner("Batch Lookup Test");
+
+  KDTree<2, size_t> kd;
+  for (size_t i = 0; i < 100; ++i) kd.insert(make_point(i % 10, i / 10), i);
+
+  std::vector<Point<2> > queries;
+  for (size_t i = 0; i < 100; ++i) {
+    queries.push_back(make_point(i % 10, i / 10));
+    queries.push_back(make_point(i % 10 + 0.5, i / 10));
+  }
+
+  std::vector<bool> found = kd.contains_batch(queries);
+  CHECK_CONDITION(found.size() == queries.size(),
+                  "Batch lookup answers every query.");
+  bool agrees = true;
+  for (size_t i = 0; i < queries.size(); ++i)
+    agrees = agrees && found[i] == kd.contains(queries[i]);
+  CHECK_CONDITION(agrees, "Batch lookup agrees with contains.");
+
+  std::vector<KDTree<2, size_t>::node_type*> nodes(queries.size());
+  kd.find_batch(queries.data(), queries.size(), nodes.data());
+  bool values = true;
+  for (size_t i = 0; i < queries.size(); i += 2)
+    values = values && nodes[i] && kd.payload(nodes[i]) == i / 2;
+  CHECK_CONDITION(values, "Batch lookup finds the right nodes.");
+
+  KDTree<2, size_t> empty;
+  CHECK_CONDITION(!empty.contains_batch(queries)[0],
+                  "Batch lookup on an empty tree finds nothing.");
+
+  end_test();
+#else
+  test_disabled("test_batch_lookup");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_payload_kd_tree() try {
+#if TEST_PAYLOAD_KD_TREE_ENABLED
+  print_banner("Payload KDTree Test");
+
+  KDTree<2, std::string> kd;
+  for (size_t i = 0; i < 20; ++i)
+    kd.insert(make_point(i, 0), std::string(64, static_cast<char>('a' + i)));
+  kd[make_point(0, 1)] = "fresh";
+
+  CHECK_CONDITION(kd.size() == 21, "Payload tree has the right size.");
+  CHECK_CONDITION(kd.at(make_point(3, 0)) == std::string(64, 'd'),
+                  "Payloads are stored out of line correctly.");
+  CHECK_CONDITION(kd[make_point(0, 1)] == "fresh",
+                  "operator[] creates and returns a payload.");
+
+  std::string& ref = kd.at(make_point(5, 0));
+  for (size_t i = 0; i < 100; ++i) kd.insert(make_point(i, 2), "filler");
+  CHECK_CONDITION(ref == std::string(64, 'f'),
+                  "Payload references survive later inserts.");
+
+  kd.insert(make_point(5, 0), "replaced");
+  CHECK_CONDITION(kd.at(make_point(5, 0)) == "replaced",
+                  "Insert overwrites the payload in place.");
+
+  std::vector<std::string> nearest = kd.knn_query(make_point(10.2, 0), 3);
+  CHECK_CONDITION(nearest.size() == 3 && nearest[0] == std::string(64, 'k') &&
+                      nearest[1] == std::string(64, 'l') &&
+                      nearest[2] == std::string(64, 'j'),
+                  "Nearest neighbor payloads are fetched for results.");
+
+  end_test();
+#else
+  test_disabled("test_payload_kd_tree");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_all_knn() try {
+#if TEST_ALL_KNN_ENABLED
+  print_banner("All Nearest Neighbors Test");
+
+  // integer grid coordinates so many neighbors tie on distance
+  KDTree<2, size_t> kd;
+  size_t seed = 7;
+  for (size_t i = 0; i < 400; ++i) {
+    seed = seed * 1103515245 + 12345;
+    Point<2> pt = make_point((seed >> 8) % 40, (seed >> 20) % 40);
+    if (!kd.contains(pt)) kd.insert(pt, kd.size());
+  }
+  std::vector<Point<2> > points(kd.size());
+  for (size_t x = 0; x < 40; ++x)
+    for (size_t y = 0; y < 40; ++y)
+      if (kd.contains(make_point(x, y)))
+        points[kd.at(make_point(x, y))] = make_point(x, y);
+
+  const size_t k = 6;
+  for (size_t threads = 1; threads <= 4; threads += 3) {
+    KNNGraph graph = kd.all_knn(k, threads);
+    bool shape = graph.offsets.size() == kd.size() + 1 &&
+                 graph.neighbors.size() == kd.size() * k;
+    CHECK_CONDITION(shape, "k-NN graph has k neighbors per element.");
+
+    bool same = shape;
+    for (size_t i = 0; same && i < kd.size(); ++i) {
+      std::vector<size_t> expected = kd.knn_query(points[i], k + 1);
+      for (size_t j = 0; j < k; ++j)
+        same = same && graph.neighbors[graph.offsets[i] + j] == expected[j + 1];
+    }
+    CHECK_CONDITION(same, "k-NN graph matches independent queries.");
+  }
+
+  KDTree<2, size_t> small;
+  small.insert(make_point(0, 0), 0);
+  small.insert(make_point(1, 0), 1);
+  KNNGraph graph = small.all_knn(5);
+  CHECK_CONDITION(graph.neighbors.size() == 2 && graph.neighbors[0] == 1 &&
+                      graph.neighbors[1] == 0 && graph.distances[0] == 1.0,
+                  "k larger than the tree is clamped.");
+
+  end_test();
+#else
+  test_disabled("test_all_knn");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_hash_index() try {
+#if TEST_HASH_INDEX_ENABLED
+  print_banner("Hash Index Test");
+
+  KDTree<3, size_t> kd;
+  for (size_t i = 0; i < 50; ++i) kd.insert(make_point(i, i % 7, 0), i);
+  kd.enable_hash_index();
+  CHECK_CONDITION(kd.hash_index_enabled(), "Hash index can be enabled.");
+
+  for (size_t i = 50; i < 200; ++i) kd.insert(make_point(i, i % 7, 0), i);
+  for (size_t i = 200; i < 300; ++i) kd[make_point(i, i % 7, 0)] = i;
+  kd.insert(make_point(3, 3, 0), 1000);
+
+  CHECK_CONDITION(kd.size() == 300, "Indexed tree counts new elements once.");
+  bool found = true;
+  for (size_t i = 0; i < 300; ++i)
+    found = found && kd.contains(make_point(i, i % 7, 0)) &&
+            kd.at(make_point(i, i % 7, 0)) == (i == 3 ? 1000 : i);
+  CHECK_CONDITION(found, "Hash index sees inserts and operator[].");
+  CHECK_CONDITION(!kd.contains(make_point(3, 4, 0)),
+                  "Hash index rejects missing points.");
+  CHECK_CONDITION(kd.contains(make_point(-0.0, 0, 0)),
+                  "Negative zero matches zero as in the tree.");
+
+  KDTree<3, size_t> copy = kd;
+  copy[make_point(0.5, 0, 0)] = 7;
+  CHECK_CONDITION(copy.hash_index_enabled() &&
+                      copy.at(make_point(0.5, 0, 0)) == 7 &&
+                      !kd.contains(make_point(0.5, 0, 0)),
+                  "Copies get their own hash index.");
+
+  std::vector<Point<3> > queries;
+  queries.push_back(make_point(10, 3, 0));
+  queries.push_back(make_point(10, 4, 0));
+  std::vector<bool> batch = kd.contains_batch(queries);
+  CHECK_CONDITION(batch[0] && !batch[1], "Batch lookups use the hash index.");
+
+  kd.disable_hash_index();
+  CHECK_CONDITION(!kd.hash_index_enabled() &&
+                      kd.at(make_point(42, 0, 0)) == 42,
+                  "Tree lookups work again without the index.");
+
+  end_test();
+#else
+  test_disabled("test_hash_index");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_bulk_loader() try {
+#if TEST_BULK_LOADER_ENABLED
+  print_banner("Bulk Loader Test");
+
+  // CSV: header, CRLF endings, a blank line, a repeated point, and
+  // coordinates that need both the fast and the strtod parsing paths.
+  std::vector<std::vector<double> > coords;
+  std::string csv_path = "kdtree_loader_test.csv";
+  FILE* csv = std::fopen(csv_path.c_str(), "w");
+  std::fprintf(csv, "x,y,label\r\n");
+  size_t seed = 11;
+  for (size_t i = 0; i < 3000; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    double x = static_cast<double>(seed >> 11) / (1ULL << 53) * 200 - 100;
+    double y = (i % 3 == 0) ? 1e-30 * i : static_cast<double>(i % 97) / 8;
+    coords.push_back(std::vector<double>(1, x));
+    coords.back().push_back(y);
+    std::fprintf(csv, i % 2 ? "%.17g,%.17g,label%zu\r\n" : "%.6f,%g,label%zu\n",
+                 x, y, i);
+    if (i == 1500) std::fprintf(csv, "\n");
+  }
+  std::fprintf(csv, "%.17g,%.17g,again", coords[7][0], coords[7][1]);
+  std::fclose(csv);
+
+  KDTreeStaging<2, std::string> staging;
+  LoaderOptions options;
+  options.threads = 4;
+  options.skip_header = true;
+  LoadStats stats = load_csv(csv_path, staging, options);
+  CHECK_CONDITION(stats.rows == 3001 && staging.size() == 3001,
+                  "CSV loader reads every row.");
+  bool parsed = true;
+  for (size_t i = 0; i < 3000; ++i) {
+    char text[64];
+    std::snprintf(text, sizeof(text), i % 2 ? "%.17g" : "%.6f", coords[i][0]);
+    parsed = parsed && staging.points[i][0] == std::strtod(text, nullptr);
+    std::snprintf(text, sizeof(text), i % 2 ? "%.17g" : "%g", coords[i][1]);
+    parsed = parsed && staging.points[i][1] == std::strtod(text, nullptr);
+    parsed = parsed && staging.values[i] == "label" + std::to_string(i);
+  }
+  CHECK_CONDITION(parsed, "CSV coordinates match strtod; labels are kept.");
+  CHECK_CONDITION(stats.gigabytes_per_second() > 0,
+                  "Loader reports its throughput.");
+
+  Point<2> seventh = staging.points[7];
+  KDTree<2, std::string> kd;
+  kd.bulk_load(staging);
+  CHECK_CONDITION(kd.size() == 3000 && staging.size() == 0,
+                  "Bulk load merges repeated points.");
+  CHECK_CONDITION(kd.at(seventh) == "again",
+                  "Last value of a repeated point wins.");
+  std::remove(csv_path.c_str());
+
+  // integer labels: the type's limits load, anything past them is rejected
+  csv = std::fopen(csv_path.c_str(), "w");
+  std::fprintf(csv, "1,2,2147483647\n3,4,-2147483648\n5,6,+7\n");
+  std::fclose(csv);
+  KDTreeStaging<2, int> ints;
+  load_csv(csv_path, ints);
+  CHECK_CONDITION(ints.size() == 3 && ints.values[0] == 2147483647 &&
+                      ints.values[1] == -2147483647 - 1 && ints.values[2] == 7,
+                  "Integer labels load up to the type's limits.");
+  const char* const bad_labels[] = {"99999999999999999999", "2147483648",
+                                    "-2147483649", "12x"};
+  bool rejected = true;
+  for (size_t i = 0; i < 4; ++i) {
+    csv = std::fopen(csv_path.c_str(), "w");
+    std::fprintf(csv, "1,2,5\n3,4,%s\n", bad_labels[i]);
+    std::fclose(csv);
+    bool did_throw = false;
+    try {
+      load_csv(csv_path, ints);
+    } catch (const std::runtime_error&) {
+      did_throw = true;
+    }
+    rejected = rejected && did_throw;
+  }
+  CHECK_CONDITION(rejected, "Out-of-range or malformed labels are rejected.");
+  csv = std::fopen(csv_path.c_str(), "w");
+  std::fprintf(csv, "1,2,-5\n");
+  std::fclose(csv);
+  KDTreeStaging<2, unsigned> unsigneds;
+  bool unsigned_threw = false;
+  try {
+    load_csv(csv_path, unsigneds);
+  } catch (const std::runtime_error&) {
+    unsigned_threw = true;
+  }
+  CHECK_CONDITION(unsigned_threw,
+                  "Negative labels are rejected for unsigned types.");
+  std::remove(csv_path.c_str());
+
+  // binary records with a trivially copyable payload
+  std::string bin_path = "kdtree_loader_test.bin";
+  FILE* bin = std::fopen(bin_path.c_str(), "wb");
+  for (size_t i = 0; i < 5000; ++i) {
+    double xyz[3] = {double(i % 17), double(i % 29), double(i)};
+    std::fwrite(xyz, sizeof(double), 3, bin);
+    std::fwrite(&i, sizeof(size_t), 1, bin);
+  }
+  std::fclose(bin);
+  KDTree<3, size_t> tree;
+  stats = load_file(bin_path, tree, options);
+  bool loaded = stats.rows == 5000 && tree.size() == 5000;
+  for (size_t i = 0; i < 5000; i += 37)
+    loaded = loaded && tree.at(make_point(i % 17, i % 29, i)) == i;
+  CHECK_CONDITION(loaded, "Binary file loads into a tree.");
+  std::remove(bin_path.c_str());
+
+  bool did_throw = false;
+  try {
+    load_file("kdtree_loader_missing.csv", tree);
+  } catch (const std::runtime_error&) {
+    did_throw = true;
+  }
+  CHECK_CONDITION(did_throw, "Missing files are reported.");
+
+  end_test();
+#else
+  test_disabled("test_bulk_loader");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_external_build() try {
+#if TEST_EXTERNAL_BUILD_ENABLED
+  print_banner("External Build Test");
+
+  std::string input = "kdtree_external_test.bin";
+  std::string output = "kdtree_external_test.tree";
+  std::vector<Point<3> > points;
+  FILE* bin = std::fopen(input.c_str(), "wb");
+  size_t seed = 5;
+  for (size_t i = 0; i < 20000; ++i) {
+    Point<3> pt;
+    for (size_t d = 0; d < 3; ++d) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      pt[d] = static_cast<double>(seed >> 11) / (1ULL << 53);
+    }
+    if (i % 100 == 99) pt = points[i / 2];  // repeated point, new value
+    points.push_back(pt);
+    std::fwrite(pt.begin(), sizeof(double), 3, bin);
+    std::fwrite(&i, sizeof(size_t), 1, bin);
+  }
+  std::fclose(bin);
+
+  ExternalBuildOptions options;
+  options.memory_budget = 96 << 10;
+  options.leaf_size = 16;
+  ExternalKDTreeBuilder<3, size_t> builder(options);
+  builder.build(input, output);
+  // a split pass holds the two output writers, its reader and two side
+  // writers at once
+  size_t stream = options.memory_budget / 16, split = options.memory_budget / 8;
+  size_t stored = 3 * sizeof(double) + sizeof(size_t) + sizeof(uint64_t);
+  size_t streaming = 2 * stream + split / stored * stored + 2 * split;
+  CHECK_CONDITION(builder.peak_resident_bytes() >= streaming,
+                  "External build counts its stream buffers.");
+  CHECK_CONDITION(builder.peak_resident_bytes() <= options.memory_budget,
+                  "External build stays within the memory budget.");
+
+  KDTree<3, size_t> reference;
+  load_file(input, reference);
+  ExternalKDTree<3, size_t> tree(output);
+  CHECK_CONDITION(tree.size() == reference.size(),
+                  "External tree merges repeated points.");
+
+  bool lookups = true;
+  for (size_t i = 0; i < points.size(); i += 7)
+    lookups = lookups && tree.contains(points[i]) &&
+              tree.at(points[i]) == reference.at(points[i]);
+  CHECK_CONDITION(lookups, "External tree finds every point.");
+  CHECK_CONDITION(!tree.contains(make_point(2.0, 2.0, 2.0)),
+                  "External tree rejects missing points.");
+
+  // Copies cut short or claiming more records than they hold must be
+  // refused before any query reads past the mapping.
+  std::string damaged = output + ".damaged";
+  std::string original;
+  {
+    std::ifstream from(output.c_str(), std::ios::binary);
+    original.assign(std::istreambuf_iterator<char>(from),
+                    std::istreambuf_iterator<char>());
+  }
+  bool refused = true;
+  for (size_t damage = 0; damage < 2; ++damage) {
+    std::string bytes = original;
+    if (damage == 0) {
+      bytes.resize(bytes.size() - sizeof(ExternalTreeNode));
+    } else {
+      ExternalTreeHeader header;
+      std::memcpy(&header, bytes.data(), sizeof(header));
+      header.points += header.nodes_offset / 8;
+      std::memcpy(&bytes[0], &header, sizeof(header));
+    }
+    std::ofstream(damaged.c_str(), std::ios::binary)
+        .write(bytes.data(), bytes.size());
+    bool threw = false;
+    try {
+      ExternalKDTree<3, size_t> broken(damaged);
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    refused = refused && threw;
+  }
+  std::remove(damaged.c_str());
+  CHECK_CONDITION(refused, "External tree rejects truncated or corrupt files.");
+
+  bool knn = true;
+  for (size_t i = 0; i < 50; ++i) {
+    Point<3> key = make_point(i / 50.0, 0.5, 1 - i / 50.0);
+    knn = knn && tree.knn_query(key, 8) == reference.knn_query(key, 8);
+  }
+  CHECK_CONDITION(knn, "External k-NN matches the in-memory tree.");
+
+  // Integer grid staged in shuffled order with repeats: equal distances
+  // must come out in input order, across on-disk partitions.
+  bin = std::fopen(input.c_str(), "wb");
+  for (size_t i = 0; i < 6000; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    size_t cell = (seed >> 33) % 3375;
+    Point<3> pt = make_point(cell % 15, cell / 15 % 15, cell / 225);
+    std::fwrite(pt.begin(), sizeof(double), 3, bin);
+    std::fwrite(&i, sizeof(size_t), 1, bin);
+  }
+  std::fclose(bin);
+  builder.build(input, output);
+  KDTree<3, size_t> grid;
+  load_file(input, grid);
+  ExternalKDTree<3, size_t> gridTree(output);
+  bool ties = gridTree.size() == grid.size();
+  for (size_t i = 0; i < 200; ++i) {
+    Point<3> key = make_point(i % 15, i * 7 % 15, i * 11 % 15);
+    ties = ties && gridTree.knn_query(key, 8) == grid.knn_query(key, 8);
+  }
+  CHECK_CONDITION(ties, "External k-NN breaks ties by input order.");
+
+  // A failed partition write must not leave scratch files behind.
+  std::string blocked = output + ".part1";
+  mkdir(blocked.c_str(), 0700);
+  ExternalKDTreeBuilder<3, size_t> failing(options);
+  bool threw = false;
+  try {
+    failing.build(input, output);
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  rmdir(blocked.c_str());
+  struct stat info;
+  CHECK_CONDITION(threw && stat((output + ".part0").c_str(), &info) != 0,
+                  "Failed external build removes its temp files.");
+
+  std::remove(input.c_str());
+  std::remove(output.c_str());
+  end_test();
+#else
+  test_disabled("test_external_build");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_sharded_kd_tree() try {
+#if TEST_SHARDED_KD_TREE_ENABLED
+  print_banner("Sharded KDTree Test");
+
+  KDTreeStaging<2, size_t> staging;
+  size_t seed = 3;
+  for (size_t i = 0; i < 4000; ++i) {
+    Point<2> pt;
+    for (size_t d = 0; d < 2; ++d) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      pt[d] = static_cast<double>(seed >> 11) / (1ULL << 53) * 100;
+    }
+    staging.points.push_back(pt);
+    staging.values.push_back(i);
+  }
+  KDTreeStaging<2, size_t> copy = staging;
+  KDTree<2, size_t> reference;
+  reference.bulk_load(copy);
+
+  const ShardPartition modes[] = {ShardPartition::kTopSplits,
+                                  ShardPartition::kMortonRanges};
+  for (size_t m = 0; m < 2; ++m) {
+    ShardedKDTree<2, size_t> sharded(4, modes[m]);
+    copy = staging;
+    sharded.build(copy);
+    CHECK_CONDITION(sharded.size() == 4000, "Shards hold every point.");
+    bool balanced = true;
+    for (size_t s = 0; s < sharded.shard_count(); ++s)
+      balanced = balanced && sharded.shard(s).size() == 1000;
+    CHECK_CONDITION(balanced, "Shards are balanced.");
+
+    bool lookups = true;
+    for (size_t i = 0; i < 4000; i += 13)
+      lookups = lookups && sharded.at(staging.points[i]) == i;
+    CHECK_CONDITION(lookups, "Exact lookups route to the right shard.");
+
+    bool knn = true, radius = true;
+    size_t fanout = 0;
+    for (size_t i = 0; i < 100; ++i) {
+      Point<2> key = make_point(i, (i * 37) % 100);
+      knn = knn && sharded.knn_query(key, 10) == reference.knn_query(key, 10);
+      fanout += ShardedKDTree<2, size_t>::last_fanout();
+      std::vector<size_t> expected;
+      std::vector<std::pair<double, uint32_t> > hits =
+          reference.radius_search(key, 7.5);
+      for (size_t h = 0; h < hits.size(); ++h)
+        expected.push_back(reference.payload_by_id(hits[h].second));
+      radius = radius && sharded.radius_query(key, 7.5) == expected;
+    }
+    CHECK_CONDITION(knn, "Sharded k-NN matches a single tree.");
+    CHECK_CONDITION(radius, "Sharded radius query matches a single tree.");
+    CHECK_CONDITION(fanout < 100 * 4, "Queries skip shards out of reach.");
+
+    sharded.insert(make_point(-5, -5), 9999);
+    CHECK_CONDITION(sharded.contains(make_point(-5, -5)) &&
+                        sharded.knn_query(make_point(-6, -6), 1)[0] == 9999,
+                    "Inserts outside the built bounds are found.");
+  }
+
+  // Integer grid with every point staged twice in shuffled order: repeats
+  // keep the last value and equal distances tie on insertion order.
+  KDTreeStaging<2, size_t> grid;
+  for (size_t i = 0; i < 4000; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    size_t cell = (seed >> 33) % 1600;
+    grid.points.push_back(make_point(cell % 40, cell / 40));
+    grid.values.push_back(i);
+  }
+  copy = grid;
+  KDTree<2, size_t> gridReference;
+  gridReference.bulk_load(copy);
+  for (size_t m = 0; m < 2; ++m) {
+    ShardedKDTree<2, size_t> sharded(4, modes[m]);
+    copy = grid;
+    sharded.build(copy);
+    CHECK_CONDITION(sharded.size() == gridReference.size(),
+                    "Repeated points are stored once.");
+    bool lookups = true;
+    for (size_t i = 0; i < 4000; ++i)
+      lookups = lookups &&
+                sharded.at(grid.points[i]) == gridReference.at(grid.points[i]);
+    CHECK_CONDITION(lookups, "Repeated points keep their last value.");
+
+    sharded.insert(make_point(20, 41), 7777);
+    KDTree<2, size_t> after = gridReference;
+    after.insert(make_point(20, 41), 7777);
+    bool ties = true;
+    for (size_t i = 0; i < 200; ++i) {
+      Point<2> key = make_point((i * 7) % 41, (i * 13) % 42);
+      ties = ties && sharded.knn_query(key, 6) == after.knn_query(key, 6);
+    }
+    CHECK_CONDITION(ties, "Sharded k-NN breaks ties by insertion order.");
+  }
+
+  end_test();
+#else
+  test_disabled("test_sharded_kd_tree");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_query_cache() try {
+#if TEST_QUERY_CACHE_ENABLED
+  print_banner("Query Cache Test");
+
+  KDTree<2, size_t> kd;
+  for (size_t i = 0; i < 100; ++i) kd.insert(make_point(i % 10, i / 10), i);
+  kd.enable_query_cache(4);
+  CHECK_CONDITION(kd.query_cache_enabled(), "Query cache can be enabled.");
+
+  Point<2> hot = make_point(3.2, 4.1);
+  std::vector<size_t> expected = kd.knn_query(hot, 5);
+  bool same = true;
+  for (size_t i = 0; i < 10; ++i)
+    same = same && kd.knn_query(hot, 5) == expected;
+  QueryCacheStats stats = kd.query_cache_stats();
+  CHECK_CONDITION(same && stats.misses == 1 && stats.hits == 10,
+                  "Repeated queries are served from the cache.");
+  kd.knn_query(hot, 6);
+  CHECK_CONDITION(kd.query_cache_stats().misses == 2,
+                  "k is part of the cache key.");
+
+  for (size_t i = 0; i < 10; ++i) kd.knn_query(make_point(i, 20), 1);
+  CHECK_CONDITION(kd.query_cache_stats().evictions > 0,
+                  "The cache stays within its capacity.");
+
+  kd.knn_query(hot, 1);
+  kd.insert(make_point(3.2, 4.1), 500);
+  CHECK_CONDITION(kd.knn_query(hot, 1)[0] == 500,
+                  "Inserting a point invalidates cached results.");
+  kd[make_point(3.2, 4.1)] = 501;
+  CHECK_CONDITION(kd.knn_value(hot, 1) == 501,
+                  "Updated payloads are read through the cache.");
+
+  KDTree<2, size_t> quantized;
+  for (size_t i = 0; i < 100; ++i)
+    quantized.insert(make_point(i % 10, i / 10), i);
+  quantized.enable_query_cache(16, 0.5);
+  quantized.knn_query(make_point(3.1, 3.1), 1);
+  quantized.knn_query(make_point(3.3, 3.4), 1);
+  stats = quantized.query_cache_stats();
+  CHECK_CONDITION(stats.hits == 1 && stats.hit_rate() == 0.5,
+                  "Queries in one grid cell share an entry.");
+
+  KDTree<2, size_t> copy = kd;
+  CHECK_CONDITION(copy.query_cache_enabled() &&
+                      copy.query_cache_stats().hits == 0,
+                  "Copies get their own cold cache.");
+  kd.disable_query_cache();
+  CHECK_CONDITION(!kd.query_cache_enabled() &&
+                      kd.knn_query(hot, 5) == copy.knn_query(hot, 5),
+                  "Queries work again without the cache.");
+
+  end_test();
+#else
+  test_disabled("test_query_cache");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_box_search() try {
+#if TEST_BOX_SEARCH_ENABLED
+  print_banner("Box Search Test");
+
+  KDTree<3, size_t> kd;
+  std::vector<Point<3> > points;
+  for (size_t i = 0; i < 1000; ++i) {
+    points.push_back(make_point(i % 10, (i / 10) % 10, i / 100));
+    kd.insert(points.back(), i);
+  }
+  Point<3> lo = make_point(2, 3, 4), hi = make_point(5, 3, 8.5);
+  std::vector<uint32_t> expected;
+  for (size_t i = 0; i < points.size(); ++i) {
+    bool inside = true;
+    for (size_t d = 0; d < 3; ++d)
+      inside = inside && lo[d] <= points[i][d] && points[i][d] <= hi[d];
+    if (inside) expected.push_back(static_cast<uint32_t>(i));
+  }
+  CHECK_CONDITION(kd.box_search(lo, hi) == expected,
+                  "Box search matches a linear scan, bounds included.");
+  CHECK_CONDITION(kd.box_search(hi, lo).empty(),
+                  "An inverted box is empty.");
+  CHECK_CONDITION(kd.box_search(make_point(7, 7, 7), make_point(7, 7, 7)) ==
+                      std::vector<uint32_t>(1, 777),
+                  "A degenerate box finds the point on it.");
+
+  end_test();
+#else
+  test_disabled("test_box_search");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_compact_kd_tree() try {
+#if TEST_COMPACT_KD_TREE_ENABLED
+  print_banner("Compact KDTree Test");
+
+  // a coarse grid mixed with random points: many equal coordinates
+  KDTree<3, size_t> kd;
+  size_t seed = 11;
+  for (size_t i = 0; i < 3000; ++i) {
+    Point<3> pt;
+    for (size_t d = 0; d < 3; ++d) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      double coord = static_cast<double>(seed >> 11) / (1ULL << 53) * 50;
+      pt[d] = i % 2 ? coord : std::floor(coord / 5);
+    }
+    kd.insert(pt, i);
+  }
+  CompactKDTree<3, size_t> compact(kd);
+  CHECK_CONDITION(compact.size() == kd.size(),
+                  "Compact tree holds every point.");
+
+  KDTreeStaging<3, size_t> staging;
+  kd.export_to(staging);
+  bool lookups = true;
+  for (size_t i = 0; i < staging.size(); ++i)
+    lookups = lookups && compact.at(staging.points[i]) == staging.values[i];
+  CHECK_CONDITION(lookups && !compact.contains(make_point(0.5, 0.5, 0.5)),
+                  "Exact lookups match the source tree.");
+
+  bool knn = true, radius = true, box = true;
+  for (size_t i = 0; i < 200; ++i) {
+    Point<3> key = make_point(i % 50, (i * 7) % 50, (i * 13) % 50);
+    knn = knn && compact.knn_search(key, 7) == kd.knn_search(key, 7);
+    radius = radius &&
+             compact.radius_search(key, 4.0) == kd.radius_search(key, 4.0);
+    Point<3> hi = make_point(key[0] + 6, key[1] + 3, key[2] + 9);
+    box = box && compact.box_search(key, hi) == kd.box_search(key, hi);
+  }
+  CHECK_CONDITION(knn, "Compact k-NN is exact, ties included.");
+  CHECK_CONDITION(radius, "Compact radius search is exact.");
+  CHECK_CONDITION(box, "Compact box search is exact.");
+  CHECK_CONDITION(compact.knn_query(make_point(1, 2, 3), 5) ==
+                      kd.knn_query(make_point(1, 2, 3), 5),
+                  "Compact k-NN returns the same payloads.");
+  CHECK_CONDITION(compact.hot_bytes() * 4 < kd.size() * sizeof(KDTreeNode<3>),
+                  "Traversal data is a fraction of the pointer tree.");
+
+  CompactKDTree<3, size_t> none((KDTree<3, size_t>()));
+  CHECK_CONDITION(
+      none.empty() && none.knn_search(make_point(0, 0, 0), 3).empty(),
+      "An empty compact tree answers nothing.");
+
+  end_test();
+#else
+  test_disabled("test_compact_kd_tree");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_bounding_boxes() try {
+#if TEST_BOUNDING_BOXES_ENABLED
+  print_banner("Bounding Boxes Test");
+
+  KDTree<2, size_t> plain, boxed;
+  boxed.enable_bounding_boxes();
+  CHECK_CONDITION(boxed.bounding_boxes_enabled(), "Boxes can be enabled.");
+  size_t seed = 5;
+  for (size_t i = 0; i < 3000; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    double x = static_cast<double>(seed >> 40) / (1 << 24) * 40;
+    Point<2> pt = make_point(std::floor(x), i % 37);
+    plain.insert(pt, i);
+    boxed.insert(pt, i);
+  }
+  CHECK_CONDITION(sizeof(KDTreeNode<2>) ==
+                      sizeof(Point<2>) + 2 * sizeof(uint32_t) +
+                          2 * sizeof(KDTreeNode<2>*),
+                  "The box index fits in the node's padding.");
+
+  bool knn = true, radius = true, box = true;
+  for (size_t i = 0; i < 200; ++i) {
+    Point<2> key = make_point(i % 41 - 0.5, (i * 7) % 37);
+    knn = knn && boxed.knn_search(key, 6) == plain.knn_search(key, 6);
+    radius = radius &&
+             boxed.radius_search(key, 5.0) == plain.radius_search(key, 5.0);
+    Point<2> hi = make_point(key[0] + 10, key[1] + 4);
+    box = box && boxed.box_search(key, hi) == plain.box_search(key, hi);
+  }
+  CHECK_CONDITION(knn, "Box-pruned k-NN matches the plain tree.");
+  CHECK_CONDITION(radius, "Box-pruned radius search matches the plain tree.");
+  CHECK_CONDITION(box, "Box-pruned box search matches the plain tree.");
+  CHECK_CONDITION(boxed.box_search(make_point(-1, -1), make_point(100, 100))
+                          .size() == boxed.size(),
+                  "A box covering the tree returns every element.");
+
+  KDTreeStaging<2, size_t> staging;
+  plain.export_to(staging);
+  KDTree<2, size_t> loaded;
+  loaded.enable_bounding_boxes();
+  loaded.bulk_load(staging);
+  loaded.insert(make_point(-20, -20), 9999);
+  KDTree<2, size_t> copy = loaded;
+  CHECK_CONDITION(copy.bounding_boxes_enabled() &&
+                      copy.knn_query(make_point(-19, -19), 1)[0] == 9999 &&
+                      copy.radius_search(make_point(10, 10), 6.0) ==
+                          plain.radius_search(make_point(10, 10), 6.0),
+                  "Boxes follow bulk loads, inserts and copies.");
+
+  end_test();
+#else
+  test_disabled("test_bounding_boxes");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_async_query() try {
+#if TEST_ASYNC_QUERY_ENABLED
+  print_banner("Async Query Test");
+
+  KDTree<2, size_t> kd;
+  for (size_t i = 0; i < 2000; ++i)
+    kd.insert(make_point((i * 7919) % 1000, (i * 104729) % 997), i);
+
+  // single-threaded event loop
+  std::deque<std::function<void()> > loop;
+  AsyncExecutor executor = [&loop](std::function<void()> job) {
+    loop.push_back(job);
+  };
+  size_t slices = 0;
+  std::vector<std::pair<double, uint32_t> > results[50];
+  AsyncStatus statuses[50];
+  AsyncQueryOptions options;
+  options.slice_nodes = 16;
+  for (size_t i = 0; i < 50; ++i) {
+    kd.knn_search_async(
+        make_point(i * 20, i * 19), 10, executor,
+        [&results, &statuses, i](AsyncStatus status,
+                                 std::vector<std::pair<double, uint32_t> > r) {
+          statuses[i] = status;
+          results[i] = r;
+        },
+        options);
+  }
+  CHECK_CONDITION(loop.size() == 50, "Queries start on the executor.");
+  for (; !loop.empty(); ++slices) {
+    std::function<void()> job = loop.front();
+    loop.pop_front();
+    job();
+  }
+  bool same = true;
+  for (size_t i = 0; i < 50; ++i)
+    same = same && statuses[i] == AsyncStatus::kDone &&
+           results[i] == kd.knn_search(make_point(i * 20, i * 19), 10);
+  CHECK_CONDITION(same, "Async results match knn_search.");
+  CHECK_CONDITION(slices > 2 * 50, "Queries yield between slices.");
+
+  AsyncStatus status = AsyncStatus::kDone;
+  std::vector<std::pair<double, uint32_t> > partial;
+  KNNCallback keep = [&status, &partial](
+                         AsyncStatus s,
+                         std::vector<std::pair<double, uint32_t> > r) {
+    status = s;
+    partial = r;
+  };
+  AsyncQueryOptions late;
+  late.deadline = std::chrono::steady_clock::now();
+  kd.knn_search_async(make_point(0, 0), 5, executor, keep, late);
+  while (!loop.empty()) {
+    std::function<void()> job = loop.front();
+    loop.pop_front();
+    job();
+  }
+  CHECK_CONDITION(status == AsyncStatus::kDeadlineExceeded && partial.empty(),
+                  "A passed deadline stops the query.");
+
+  AsyncQueryOptions cancellable;
+  cancellable.slice_nodes = 4;
+  kd.knn_search_async(make_point(500, 500), 5, executor, keep, cancellable);
+  loop.front()();
+  loop.pop_front();
+  cancellable.token.cancel();
+  while (!loop.empty()) {
+    std::function<void()> job = loop.front();
+    loop.pop_front();
+    job();
+  }
+  CHECK_CONDITION(status == AsyncStatus::kCancelled && !partial.empty() &&
+                      partial.size() <= 5,
+                  "Cancellation returns the candidates found so far.");
+
+  // an inline executor: every slice runs inside the previous submit
+  size_t nesting = 0, deepest = 0, inlineSlices = 0;
+  AsyncExecutor inline_executor = [&](std::function<void()> job) {
+    ++inlineSlices;
+    deepest = std::max(deepest, ++nesting);
+    job();
+    --nesting;
+  };
+  AsyncQueryOptions tiny;
+  tiny.slice_nodes = 1;
+  status = AsyncStatus::kCancelled;
+  kd.knn_search_async(make_point(300, 700), kd.size(), inline_executor, keep,
+                      tiny);
+  CHECK_CONDITION(status == AsyncStatus::kDone &&
+                      partial == kd.knn_search(make_point(300, 700), kd.size()),
+                  "An inline executor runs the query to completion.");
+  CHECK_CONDITION(inlineSlices >= kd.size() && deepest <= 2,
+                  "Inline slices loop instead of nesting.");
+
+  end_test();
+#else
+  test_disabled("test_async_query");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
+void test_batch_insert() try {
+#if TEST_BATCH_INSERT_ENABLED
+  print_banner("Batch Insert Test");
+
+  // the same three batches, one point at a time and as batches
+  KDTree<2, size_t> single, batched;
+  batched.enable_hash_index();
+  batched.enable_bounding_boxes();
+  batched.enable_query_cache(8);
+  size_t seed = 17;
+  for (size_t round = 0; round < 3; ++round) {
+    std::vector<std::pair<Point<2>, size_t> > batch;
+    size_t count = round == 1 ? 20 : 2000;
+    for (size_t i = 0; i < count; ++i) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      // a small grid, so batches repeat points and hit existing ones
+      Point<2> pt = make_point((seed >> 33) % 60, (seed >> 45) % 60);
+      batch.push_back(std::make_pair(pt, round * 10000 + i));
+    }
+    for (size_t i = 0; i < batch.size(); ++i)
+      single.insert(batch[i].first, batch[i].second);
+    batched.knn_query(make_point(30, 30), 4);
+    batched.insert_batch(batch.begin(), batch.end());
+  }
+  CHECK_CONDITION(batched.size() == single.size(),
+                  "Batches count each new point once.");
+
+  KDTreeStaging<2, size_t> one, two;
+  single.export_to(one);
+  batched.export_to(two);
+  CHECK_CONDITION(one.points == two.points && one.values == two.values,
+                  "Batches give the ids and values of single inserts.");
+
+  bool lookups = true, knn = true, box = true;
+  for (size_t i = 0; i < one.size(); ++i)
+    lookups = lookups && batched.at(one.points[i]) == one.values[i];
+  for (size_t i = 0; i < 100; ++i) {
+    Point<2> key = make_point(i % 61, (i * 7) % 61);
+    knn = knn && batched.knn_search(key, 5) == single.knn_search(key, 5);
+    Point<2> hi = make_point(key[0] + 8, key[1] + 5);
+    box = box && batched.box_search(key, hi) == single.box_search(key, hi);
+  }
+  CHECK_CONDITION(lookups, "Hash index sees batched points.");
+  CHECK_CONDITION(knn, "k-NN after batches matches single inserts.");
+  CHECK_CONDITION(box, "Bounding boxes follow batches.");
+  CHECK_CONDITION(batched.query_cache_stats().invalidations > 0,
+                  "Batches invalidate the query cache.");
+
+  // batches that each land past the previous one deepen a single path
+  // until the height bound forces subtrees to be rebuilt
+  KDTree<2, size_t> line, lineBatched;
+  lineBatched.enable_hash_index();
+  lineBatched.enable_bounding_boxes();
+  for (size_t round = 0; round < 40; ++round) {
+    std::vector<std::pair<Point<2>, size_t> > batch;
+    for (size_t i = 0; i < 50; ++i)
+      batch.push_back(std::make_pair(make_point(round * 50 + i, round % 3),
+                                     round * 50 + i));
+    for (size_t i = 0; i < batch.size(); ++i)
+      line.insert(batch[i].first, batch[i].second);
+    lineBatched.insert_batch(batch.begin(), batch.end());
+  }
+  line.export_to(one);
+  lineBatched.export_to(two);
+  bool rebuilt = one.points == two.points && one.values == two.values;
+  for (size_t i = 0; i < one.size(); i += 3)
+    rebuilt = rebuilt && lineBatched.at(one.points[i]) == one.values[i];
+  for (size_t i = 0; i < 50; ++i) {
+    Point<2> key = make_point(i * 41 % 2000, 1);
+    Point<2> hi = make_point(key[0] + 30, 2);
+    rebuilt = rebuilt &&
+              lineBatched.knn_search(key, 6) == line.knn_search(key, 6) &&
+              lineBatched.box_search(key, hi) == line.box_search(key, hi);
+  }
+  CHECK_CONDITION(rebuilt, "Rebuilt subtrees keep every point and id.");
+
+  std::vector<std::pair<Point<2>, size_t> > none;
+  size_t before = batched.size();
+  batched.insert_batch(none.begin(), none.end());
+  CHECK_CONDITION(batched.size() == before, "An empty batch changes nothing.");
+
+  end_test();
+#else
+  test_disabled("test_batch_insert");
+#endif
+} catch (const std::exception& e) {
+  fail_test(e);
+}
+
 int main() {
   test_basic_kd_tree();
   test_moderate_kd_tree();
@@ -625,12 +1627,32 @@ int main() {
   test_basic_copy();
   test_moderate_copy();
 
+  test_batch_lookup();
+  test_payload_kd_tree();
+  test_all_knn();
+  test_hash_index();
+  test_bulk_loader();
+  test_external_build();
+  test_sharded_kd_tree();
+  test_query_cache();
+  test_box_search();
+  test_compact_kd_tree();
+  test_bounding_boxes();
+  test_async_query();
+  test_batch_insert();
+
 #if (TEST_BASIC_KD_TREE_ENABLED && TEST_MODERATE_KD_TREE_ENABLED &&    \
      TEST_HARDER_KD_TREE_ENABLED && TEST_EDGE_CASE_KD_TREE_ENABLED &&  \
      TEST_MUTATING_KD_TREE_ENABLED && TEST_THROWING_KD_TREE_ENABLED && \
      TEST_CONST_KD_TREE_ENABLED && TEST_NEAREST_NEIGHBOR_ENABLED &&    \
      TEST_MORE_NEAREST_NEIGHBOR_ENABLED && TEST_BASIC_COPY_ENABLED &&  \
-     TEST_MODERATE_COPY_ENABLED)
+     TEST_MODERATE_COPY_ENABLED && TEST_BATCH_LOOKUP_ENABLED &&        \
+     TEST_PAYLOAD_KD_TREE_ENABLED && TEST_ALL_KNN_ENABLED &&          \
+     TEST_HASH_INDEX_ENABLED && TEST_BULK_LOADER_ENABLED &&            \
+     TEST_EXTERNAL_BUILD_ENABLED && TEST_SHARDED_KD_TREE_ENABLED &&    \
+     TEST_QUERY_CACHE_ENABLED && TEST_BOX_SEARCH_ENABLED &&            \
+     TEST_COMPACT_KD_TREE_ENABLED && TEST_BOUNDING_BOXES_ENABLED &&    \
+     TEST_ASYNC_QUERY_ENABLED && TEST_BATCH_INSERT_ENABLED)
   std::cout << "All tests completed!  If they passed, you should be good to go!"
             << std::endl
             << std::endl;